@@ -6,7 +6,9 @@
  * @brief   An introductory character driver to support the second article of my series on
  * Linux loadable kernel module (LKM) development. This module maps to /dev/char_dev_example and
  * comes with a helper C program that can be run in Linux user space to communicate with
- * this the LKM.
+ * this the LKM. Each of the device_count devices /dev/char_dev_example<N> is a buffer of buffer_size
+ * bytes that behaves like a fixed size file: read/write at the file offset, lseek, and mmap of the
+ * buffer pages for zero copy access. Devices share nothing, so clients of different ones don't contend.
  * @see http://www.derekmolloy.ie/ for a full description and follow-up descriptions.
  */
 
@@ -15,41 +17,139 @@
 #include <linux/device.h>         // Header to support the kernel Driver Model
 #include <linux/kernel.h>         // Contains types, macros, functions for the kernel
 #include <linux/fs.h>             // Header for the Linux file system support
+#include <linux/vmalloc.h>        // vmalloc_user
+#include <linux/mm.h>             // remap_vmalloc_range
+#include <linux/slab.h>           // kcalloc
+#include <linux/rwsem.h>
+#include <linux/atomic.h>
+#include <linux/uio.h>            // iov_iter
 #include <asm/uaccess.h>          // Required for the copy to user function
 
-#define  DEVICE_NAME "char_dev_example"    ///< The device will appear at /dev/char_dev_example using this value
+#define  DEVICE_NAME "char_dev_example"    ///< The devices will appear at /dev/char_dev_example0, /dev/char_dev_example1...
 #define  CLASS_NAME  "char_dev_example"    ///< The device class -- this is a character device driver
+#define  MAX_BUFFER_SIZE (1 << 30)         ///< Largest buffer the module agrees to allocate
+#define  MAX_DEVICE_COUNT 256              ///< register_chrdev reserves this many minor numbers
 
 MODULE_LICENSE("GPL");            ///< The license type -- this affects available functionality
 MODULE_AUTHOR("Derek Molloy");    ///< The author -- visible when you use modinfo
 MODULE_DESCRIPTION("A simple Linux char driver");  ///< The description -- see modinfo
 MODULE_VERSION("0.1");            ///< A version number to inform users
 
+static unsigned int device_count = 1;      ///< Number of devices, each one is a separate minor
+module_param(device_count, uint, S_IRUGO);
+MODULE_PARM_DESC(device_count, "Number of devices, /dev/char_dev_example0 .. /dev/char_dev_example<device_count - 1>");
+
+static unsigned int buffer_size = 1 << 20; ///< Size of each device buffer, the "file size" of the device
+module_param(buffer_size, uint, S_IRUGO);
+MODULE_PARM_DESC(buffer_size, "Size of each device buffer in bytes");
+
+/** @brief A device with all its state */
+struct char_dev {
+   char *buffer;                  ///< Device data, page aligned vmalloc memory so it can be mmapped
+   struct rw_semaphore lock;      ///< Readers of the buffer share it, a writer has it alone
+   atomic_t opens;                ///< Counts the number of times the device is opened
+   atomic64_t reads;              ///< Statistics, shown in /sys/class/char_dev_example/char_dev_example<N>/
+   atomic64_t writes;
+   atomic64_t bytes_read;
+   atomic64_t bytes_written;
+   struct device *device;
+};
+
+/** @brief State of a single open file of a device */
+struct char_dev_file {
+   struct char_dev *dev;          ///< The device the file was opened on
+   u64 bytes_read;                ///< Bytes moved through this file, reported on close
+   u64 bytes_written;
+};
+
 static int    majorNumber;                  ///< Stores the device number -- determined automatically
-static char   message[256] = {0};           ///< Memory for the string that is passed from userspace
-static short  size_of_message;              ///< Used to remember the size of the string stored
-static int    numberOpens = 0;              ///< Counts the number of times the device is opened
+static struct char_dev *devices = NULL;     ///< device_count devices, the minor number is the index
 static struct class*  _class  = NULL; ///< The device-driver class struct pointer
-static struct device* _device = NULL; ///< The device-driver device struct pointer
 
 // The prototype functions for the character driver -- must come before the struct definition
 static int     dev_open(struct inode *, struct file *);
 static int     dev_release(struct inode *, struct file *);
-static ssize_t dev_read(struct file *, char *, size_t, loff_t *);
-static ssize_t dev_write(struct file *, const char *, size_t, loff_t *);
+static ssize_t dev_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t dev_write_iter(struct kiocb *, struct iov_iter *);
+static loff_t  dev_llseek(struct file *, loff_t, int);
+static int     dev_mmap(struct file *, struct vm_area_struct *);
 
 /** @brief Devices are represented as file structure in the kernel. The file_operations structure from
  *  /linux/fs.h lists the callback functions that you wish to associated with your file operations
- *  using a C99 syntax structure. char devices usually implement open, read, write and release calls
+ *  using a C99 syntax structure. char devices usually implement open, read, write and release calls.
+ *  read_iter/write_iter serve read/write, readv/writev, pread/pwrite and aio/io_uring alike
  */
 static struct file_operations fops =
 {
+   .owner = THIS_MODULE,            ///< Pin the module while a device file is open, so rmmod can't pull the code
    .open = dev_open,
-   .read = dev_read,
-   .write = dev_write,
+   .read_iter = dev_read_iter,
+   .write_iter = dev_write_iter,
+   .llseek = dev_llseek,
+   .mmap = dev_mmap,
    .release = dev_release,
 };
 
+/** @brief sysfs /sys/class/char_dev_example/char_dev_example<N>/ statistics of the device
+ */
+static ssize_t opens_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct char_dev *char_dev = dev_get_drvdata(dev);
+   return sprintf(buf, "%d\n", atomic_read(&char_dev->opens));
+}
+
+#define CHAR_DEV_STAT_ATTR(counter)                                                               \
+static ssize_t counter##_show(struct device *dev, struct device_attribute *attr, char *buf){      \
+   struct char_dev *char_dev = dev_get_drvdata(dev);                                              \
+   return sprintf(buf, "%lld\n", (long long)atomic64_read(&char_dev->counter));                   \
+}                                                                                                 \
+static DEVICE_ATTR_RO(counter)
+
+static DEVICE_ATTR_RO(opens);
+CHAR_DEV_STAT_ATTR(reads);
+CHAR_DEV_STAT_ATTR(writes);
+CHAR_DEV_STAT_ATTR(bytes_read);
+CHAR_DEV_STAT_ATTR(bytes_written);
+
+static struct attribute *char_dev_attrs[] = {
+   &dev_attr_opens.attr,
+   &dev_attr_reads.attr,
+   &dev_attr_writes.attr,
+   &dev_attr_bytes_read.attr,
+   &dev_attr_bytes_written.attr,
+   NULL,
+};
+
+static const struct attribute_group char_dev_group = {
+   .attrs = char_dev_attrs,
+};
+
+static const struct attribute_group *char_dev_groups[] = {
+   &char_dev_group,
+   NULL,
+};
+
+/** @brief Allocate the device buffer and set up its lock and statistics
+ *  @return returns 0 if successful
+ */
+static int init_char_dev(struct char_dev *dev){
+   dev->buffer = vmalloc_user(buffer_size);  // zeroed, and whole pages, so it can be mapped to user space
+   if (!dev->buffer)
+      return -ENOMEM;
+   init_rwsem(&dev->lock);
+   atomic_set(&dev->opens, 0);
+   atomic64_set(&dev->reads, 0);
+   atomic64_set(&dev->writes, 0);
+   atomic64_set(&dev->bytes_read, 0);
+   atomic64_set(&dev->bytes_written, 0);
+   return 0;
+}
+
+/** @brief Release the device buffer back to the kernel
+ */
+static void clean_char_dev(struct char_dev *dev){
+   vfree(dev->buffer);
+}
+
 /** @brief The LKM initialization function
  *  The static keyword restricts the visibility of the function to within this C file. The __init
  *  macro means that for a built-in driver (not a LKM) the function is only used at initialization
@@ -57,35 +157,70 @@ static struct file_operations fops =
  *  @return returns 0 if successful
  */
 static int __init char_dev_example_init(void){
+   unsigned int i;
+   int ret;
+
    printk(KERN_INFO "char_dev_example: Initializing the char_dev_example LKM\n");
 
+   if (device_count < 1 || device_count > MAX_DEVICE_COUNT){
+      printk(KERN_ALERT "char_dev_example: device_count must be 1..%u\n", MAX_DEVICE_COUNT);
+      return -EINVAL;
+   }
+   if (buffer_size < 1 || buffer_size > MAX_BUFFER_SIZE){
+      printk(KERN_ALERT "char_dev_example: buffer_size must be 1..%u\n", MAX_BUFFER_SIZE);
+      return -EINVAL;
+   }
+   devices = kcalloc(device_count, sizeof(*devices), GFP_KERNEL);
+   if (!devices)
+      return -ENOMEM;
+   for (i = 0; i < device_count; i++){
+      ret = init_char_dev(&devices[i]);
+      if (ret)
+         goto fail_devices;
+   }
+
    // Try to dynamically allocate a major number for the device -- more difficult but worth it
    majorNumber = register_chrdev(0, DEVICE_NAME, &fops);
    if (majorNumber<0){
       printk(KERN_ALERT "char_dev_example failed to register a major number\n");
-      return majorNumber;
+      ret = majorNumber;
+      goto fail_devices;
    }
    printk(KERN_INFO "char_dev_example: registered correctly with major number %d\n", majorNumber);
 
    // Register the device class
    _class = class_create(THIS_MODULE, CLASS_NAME);
    if (IS_ERR(_class)) {                // Check for error and clean up if there is
-      unregister_chrdev(majorNumber, DEVICE_NAME);
       printk(KERN_ALERT "Failed to register device class\n");
-      return PTR_ERR(_class);          // Correct way to return an error on a pointer
+      ret = PTR_ERR(_class);           // Correct way to return an error on a pointer
+      goto fail_chrdev;
    }
    printk(KERN_INFO "char_dev_example: device class registered correctly\n");
 
-   // Register the device driver
-   _device = device_create(_class, NULL, MKDEV(majorNumber, 0), NULL, DEVICE_NAME);
-   if (IS_ERR(_device)) {               // Clean up if there is an error
-      class_destroy(_class);           // Repeated code but the alternative is goto statements
-      unregister_chrdev(majorNumber, DEVICE_NAME);
-      printk(KERN_ALERT "Failed to create the device\n");
-      return PTR_ERR(_device);
+   // Register the device driver, minor number is the device index
+   for (i = 0; i < device_count; i++){
+      devices[i].device = device_create_with_groups(_class, NULL, MKDEV(majorNumber, i), &devices[i], char_dev_groups,
+                                                    DEVICE_NAME "%u", i);
+      if (IS_ERR(devices[i].device)) {  // Clean up if there is an error
+         ret = PTR_ERR(devices[i].device);
+         while (i--)
+            device_destroy(_class, MKDEV(majorNumber, i));
+         class_destroy(_class);
+         printk(KERN_ALERT "Failed to create the device\n");
+         goto fail_chrdev;
+      }
    }
-   printk(KERN_INFO "char_dev_example: device class created correctly\n"); // Made it! device was initialized
+   printk(KERN_INFO "char_dev_example: %u devices created correctly\n", device_count); // Made it! devices were initialized
    return 0;
+
+fail_chrdev:
+   unregister_chrdev(majorNumber, DEVICE_NAME);
+   i = device_count;
+fail_devices:
+   while (i--)
+      clean_char_dev(&devices[i]);
+   kfree(devices);
+   return ret;
 }
 
 /** @brief The LKM cleanup function
@@ -93,60 +228,147 @@ static int __init char_dev_example_init(void){
  *  code is used for a built-in driver (not a LKM) that this function is not required.
  */
 static void __exit char_dev_example_exit(void){
-   device_destroy(_class, MKDEV(majorNumber, 0));     // remove the device
+   unsigned int i;
+
+   for (i = 0; i < device_count; i++)
+      device_destroy(_class, MKDEV(majorNumber, i));  // remove the devices
    class_unregister(_class);                          // unregister the device class
    class_destroy(_class);                             // remove the device class
-   unregister_chrdev(majorNumber, DEVICE_NAME);             // unregister the major number
+   unregister_chrdev(majorNumber, DEVICE_NAME);       // unregister the major number
+   for (i = 0; i < device_count; i++)
+      clean_char_dev(&devices[i]);
+   kfree(devices);
    printk(KERN_INFO "char_dev_example: Goodbye from the LKM!\n");
 }
 
 /** @brief The device open function that is called each time the device is opened
- *  This will only increment the numberOpens counter in this case.
+ *  It binds the file to the device of its minor number and counts the opens of the device.
  *  @param inodep A pointer to an inode object (defined in linux/fs.h)
  *  @param filep A pointer to a file object (defined in linux/fs.h)
+ *  @return returns 0 if successful
  */
 static int dev_open(struct inode *inodep, struct file *filep){
-   numberOpens++;
-   printk(KERN_INFO "char_dev_example: Device has been opened %d time(s)\n", numberOpens);
+   unsigned int minor = iminor(inodep);
+   struct char_dev_file *file;
+
+   if (minor >= device_count)
+      return -ENODEV;
+   file = kzalloc(sizeof(*file), GFP_KERNEL);
+   if (!file)
+      return -ENOMEM;
+   file->dev = &devices[minor];
+   filep->private_data = file;
+   filep->f_mode |= FMODE_NOWAIT;    // io_uring/aio may ask for IOCB_NOWAIT, dev_read_iter/dev_write_iter honour it
+   atomic_inc(&file->dev->opens);
    return 0;
 }
 
-/** @brief This function is called whenever device is being read from user space i.e. data is
- *  being sent from the device to the user. In this case is uses the copy_to_user() function to
- *  send the buffer string to the user and captures any errors.
- *  @param filep A pointer to a file object (defined in linux/fs.h)
- *  @param buffer The pointer to the buffer to which this function writes the data
- *  @param len The length of the b
- *  @param offset The offset if required
+/** @brief Take the device lock for reading or writing. An IOCB_NOWAIT request (io_uring, aio with
+ *  RWF_NOWAIT, preadv2 with RWF_NOWAIT) must not sleep, so it only tries the lock
+ *  @return 0 with the lock held, -EAGAIN if a nowait request would have to wait for it
  */
-static ssize_t dev_read(struct file *filep, char *buffer, size_t len, loff_t *offset){
-   int error_count = 0;
-   // copy_to_user has the format ( * to, *from, size) and returns 0 on success
-   error_count = copy_to_user(buffer, message, size_of_message);
-
-   if (error_count==0){            // if true then have success
-      printk(KERN_INFO "char_dev_example: Sent %d characters to the user\n", size_of_message);
-      return (size_of_message=0);  // clear the position to the start and return 0
+static int lock_char_dev(struct char_dev *dev, struct kiocb *iocb, bool write){
+   if (iocb->ki_flags & IOCB_NOWAIT){
+      if (write ? !down_write_trylock(&dev->lock) : !down_read_trylock(&dev->lock))
+         return -EAGAIN;
+      return 0;
    }
-   else {
-      printk(KERN_INFO "char_dev_example: Failed to send %d characters to the user\n", error_count);
+   if (write)
+      down_write(&dev->lock);
+   else
+      down_read(&dev->lock);
+   return 0;
+}
+
+/** @brief This function is called whenever device is being read from user space i.e. data is
+ *  being sent from the device to the user. It copies the buffer from the file offset on to the
+ *  user buffers, up to their total length or the end of the buffer, and moves the offset past them.
+ *  @param iocb The request: file, file offset to read from and flags
+ *  @param to The user buffers, one for read/pread, many for readv
+ *  @return Bytes read, 0 at the end of the buffer, -EFAULT if nothing could be copied,
+ *  -EAGAIN if a nowait request would block
+ */
+static ssize_t dev_read_iter(struct kiocb *iocb, struct iov_iter *to){
+   struct char_dev_file *file = iocb->ki_filp->private_data;
+   struct char_dev *dev = file->dev;
+   size_t len = iov_iter_count(to), copied;
+   int ret;
+
+   if (iocb->ki_pos >= buffer_size || !len)
+      return 0;                    // end of file
+   len = min_t(size_t, len, buffer_size - iocb->ki_pos);
+
+   ret = lock_char_dev(dev, iocb, false);
+   if (ret)
+      return ret;
+   copied = copy_to_iter(dev->buffer + iocb->ki_pos, len, to);
+   up_read(&dev->lock);
+   if (!copied)
       return -EFAULT;              // Failed -- return a bad address message (i.e. -14)
-   }
+
+   iocb->ki_pos += copied;
+   file->bytes_read += copied;
+   atomic64_inc(&dev->reads);
+   atomic64_add(copied, &dev->bytes_read);
+   return copied;
 }
 
 /** @brief This function is called whenever the device is being written to from user space i.e.
- *  data is sent to the device from the user. The data is copied to the message[] array in this
- *  LKM using the sprintf() function along with the length of the string.
+ *  data is sent to the device from the user. The data of the user buffers is copied to the buffer
+ *  at the file offset, up to its end, and the offset moved past it.
+ *  @param iocb The request: file, file offset to write at and flags
+ *  @param from The user buffers, one for write/pwrite, many for writev
+ *  @return Bytes written, -ENOSPC at the end of the buffer, -EFAULT if nothing could be copied,
+ *  -EAGAIN if a nowait request would block
+ */
+static ssize_t dev_write_iter(struct kiocb *iocb, struct iov_iter *from){
+   struct char_dev_file *file = iocb->ki_filp->private_data;
+   struct char_dev *dev = file->dev;
+   size_t len = iov_iter_count(from), copied;
+   int ret;
+
+   if (!len)
+      return 0;
+   if (iocb->ki_pos >= buffer_size)
+      return -ENOSPC;              // the buffer doesn't grow
+   len = min_t(size_t, len, buffer_size - iocb->ki_pos);
+
+   // a write is atomic to readers of the same device, as on a regular file
+   ret = lock_char_dev(dev, iocb, true);
+   if (ret)
+      return ret;
+   copied = copy_from_iter(dev->buffer + iocb->ki_pos, len, from);
+   up_write(&dev->lock);
+   if (!copied)
+      return -EFAULT;
+
+   iocb->ki_pos += copied;
+   file->bytes_written += copied;
+   atomic64_inc(&dev->writes);
+   atomic64_add(copied, &dev->bytes_written);
+   return copied;
+}
+
+/** @brief Move the file offset; the device is a file of buffer_size bytes, so SEEK_END is relative to
+ *  the buffer end and the offset can't leave the buffer
  *  @param filep A pointer to a file object
- *  @param buffer The buffer to that contains the string to write to the device
- *  @param len The length of the array of data that is being passed in the const char buffer
- *  @param offset The offset if required
+ *  @param offset The offset relative to whence
+ *  @param whence SEEK_SET, SEEK_CUR or SEEK_END
+ *  @return The new file offset, -EINVAL if it would be outside the buffer
  */
-static ssize_t dev_write(struct file *filep, const char *buffer, size_t len, loff_t *offset){
-   sprintf(message, "%s(%ld letters)", buffer, len);   // appending received string with its length
-   size_of_message = strlen(message);                 // store the length of the stored message
-   printk(KERN_INFO "char_dev_example: Received %ld characters from the user\n", len);
-   return len;
+static loff_t dev_llseek(struct file *filep, loff_t offset, int whence){
+   return fixed_size_llseek(filep, offset, whence, buffer_size);
+}
+
+/** @brief Map the device buffer pages to user space, so the data is accessed with no copy and no
+ *  system call. The mapping sees the same bytes read/write do, but takes no lock
+ *  @param filep A pointer to a file object
+ *  @param vma The user space mapping; vm_pgoff is the page of the buffer it starts at
+ *  @return 0 if successful, -EINVAL if the mapping doesn't fit in the buffer
+ */
+static int dev_mmap(struct file *filep, struct vm_area_struct *vma){
+   struct char_dev_file *file = filep->private_data;
+   return remap_vmalloc_range(vma, file->dev->buffer, vma->vm_pgoff);
 }
 
 /** @brief The device release function that is called whenever the device is closed/released by
@@ -155,7 +377,12 @@ static ssize_t dev_write(struct file *filep, const char *buffer, size_t len, lof
  *  @param filep A pointer to a file object (defined in linux/fs.h)
  */
 static int dev_release(struct inode *inodep, struct file *filep){
-   printk(KERN_INFO "char_dev_example: Device successfully closed\n");
+   struct char_dev_file *file = filep->private_data;
+
+   // every close would flood the log under load; enable with dynamic debug when needed
+   pr_debug("char_dev_example: Device %u closed, %llu bytes read, %llu bytes written\n",
+            iminor(inodep), file->bytes_read, file->bytes_written);
+   kfree(file);
    return 0;
 }
 
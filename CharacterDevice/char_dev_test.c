@@ -4,8 +4,13 @@
  * @date   7 April 2015, Nov 4, 2016
  * @version 0.1
  * @brief  A Linux user space program that communicates with the ebbchar.c LKM. It passes a
- * string to the LKM and reads the response from the LKM. For this example to work the device
- * must be called /dev/char_dev_example.
+ * string to the LKM and reads the response from the LKM. The device is /dev/char_dev_example0,
+ * or the one given as the last argument. With -a it instead compares reading blocks of the device
+ * with one pread per block against submitting them in batches through Linux aio. With -b it
+ * benchmarks the device: for each access method, block size and thread count it prints GB/s and
+ * per operation latency percentiles.
+ *
+ * usage: char_dev_test [-a] [-b [-s max block size] [-t max threads] [-n max ops per thread]] [device]
  * @see http://www.derekmolloy.ie/ for a full description and follow-up descriptions.
 */
 #include <stdio.h>
@@ -14,23 +19,332 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>               // Linux aio through raw system calls, no libaio needed
 
 #define BUFFER_LENGTH 256               ///< The buffer length (crude but fine)
 static char receive[BUFFER_LENGTH];     ///< The receive buffer from the LKM
 
-int main() {
-	int ret, fd;
+#define BATCH 64                        ///< Reads submitted with a single io_submit
+#define BLOCK 4096                      ///< Bytes of each read
+#define ROUNDS 2000                     ///< Batches read in each mode
+
+#define MAX_THREADS 64                  ///< Benchmark: most threads accessing the device at once
+#define MIN_BLOCK 512                   ///< Benchmark: smallest block, sizes go up 8 times a step
+#define BYTES_PER_THREAD (256ul << 20)  ///< Benchmark: a thread moves at most this many bytes per run
+#define IOVS 4                          ///< Benchmark: readv splits a block into this many buffers
+
+// benchmark access methods; read, write and readv go through the buffer sequentially from the file offset
+enum method { READ, WRITE, PREAD, PWRITE, READV, MMAP, METHODS };
+static const char *method_names[METHODS] = { "read", "write", "pread", "pwrite", "readv", "mmap" };
+
+static const char *path = "/dev/char_dev_example0";
+static off_t device_size;               ///< Buffer size of the device, its file size
+static unsigned long max_ops = 100000;  ///< Most operations per thread in a benchmark run
+static unsigned int max_threads = 8;
+static size_t max_block = 1 << 20;
+
+// current benchmark run
+static enum method method;
+static size_t block;
+static unsigned int threads;
+static unsigned long ops;
+static pthread_barrier_t barrier;
+static unsigned long long *latencies[MAX_THREADS]; ///< Of every operation of every thread, ns
+static unsigned long long started[MAX_THREADS], finished[MAX_THREADS]; ///< Time each thread ran, ns
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long long now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void fail(const char *what) {
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief Read ROUNDS batches of BATCH blocks, first with a pread system call per block, then with
+ * one io_submit and one io_getevents per batch, and print the reads/s of both. The aio reads ask
+ * for RWF_NOWAIT; any the driver refuses with EAGAIN as they would block are redone with pread
+ * @return 0 if successful
+ */
+static int batch_test(int fd) {
+	struct iocb iocbs[BATCH], *list[BATCH];
+	struct io_event events[BATCH];
+	aio_context_t ctx = 0;
+	unsigned long retried = 0;
+	double start, sync_time, aio_time;
+	off_t size, offsets[BATCH];
+	char *buffers;
+	int i, n, round;
+
+	size = lseek(fd, 0, SEEK_END);        // the device is a fixed size file of its buffer size
+	if (size < BLOCK) {
+		fprintf(stderr, "device buffer smaller than a %d byte block\n", BLOCK);
+		return -1;
+	}
+	for (i = 0; i < BATCH; i++)
+		offsets[i] = (off_t)i * BLOCK + BLOCK <= size ? (off_t)i * BLOCK : 0;
+	buffers = malloc(BATCH * BLOCK);
+	if (!buffers || syscall(SYS_io_setup, BATCH, &ctx) < 0) {
+		perror("io_setup");
+		return -1;
+	}
+
+	start = now();
+	for (round = 0; round < ROUNDS; round++)
+		for (i = 0; i < BATCH; i++)
+			if (pread(fd, buffers + i * BLOCK, BLOCK, offsets[i]) != BLOCK) {
+				perror("pread");
+				return -1;
+			}
+	sync_time = now() - start;
+
+	for (i = 0; i < BATCH; i++) {
+		memset(&iocbs[i], 0, sizeof(iocbs[i]));
+		iocbs[i].aio_fildes = fd;
+		iocbs[i].aio_lio_opcode = IOCB_CMD_PREAD;
+		iocbs[i].aio_buf = (__u64)(unsigned long)(buffers + i * BLOCK);
+		iocbs[i].aio_nbytes = BLOCK;
+		iocbs[i].aio_offset = offsets[i];
+#ifdef RWF_NOWAIT
+		iocbs[i].aio_rw_flags = RWF_NOWAIT;
+#endif
+		list[i] = &iocbs[i];
+	}
+
+	start = now();
+	for (round = 0; round < ROUNDS; round++) {
+		if (syscall(SYS_io_submit, ctx, BATCH, list) != BATCH) {
+			perror("io_submit");
+			return -1;
+		}
+		for (n = 0; n < BATCH; n += i) {
+			i = syscall(SYS_io_getevents, ctx, 1, BATCH - n, events + n, NULL);
+			if (i < 0) {
+				perror("io_getevents");
+				return -1;
+			}
+		}
+		for (i = 0; i < BATCH; i++) {
+			if (events[i].res == -EAGAIN) {
+				struct iocb *iocb = (struct iocb *)(unsigned long)events[i].obj;
+				events[i].res = pread(fd, (char *)(unsigned long)iocb->aio_buf, BLOCK, iocb->aio_offset);
+				retried++;
+			}
+			if (events[i].res != BLOCK) {
+				fprintf(stderr, "aio read failed: %s\n", strerror(-(int)events[i].res));
+				return -1;
+			}
+		}
+	}
+	aio_time = now() - start;
+
+	printf("%d byte reads, %d per batch\n", BLOCK, BATCH);
+	printf("pread:    %10.0f reads/s\n", ROUNDS * BATCH / sync_time);
+	printf("aio:      %10.0f reads/s, %.2fx, %lu redone after EAGAIN\n", ROUNDS * BATCH / aio_time,
+	       sync_time / aio_time, retried);
+	syscall(SYS_io_destroy, ctx);
+	free(buffers);
+	return 0;
+}
+
+/**
+ * @brief Benchmark thread: opens its own file of the device and does ops operations of the current
+ * method on consecutive blocks, starting at its own part of the buffer and wrapping around at the end
+ */
+static void *bench_thread(void *arg) {
+	unsigned int id = (unsigned long)arg;
+	size_t blocks = device_size / block, pos = blocks * id / threads, i;
+	struct iovec iov[IOVS];
+	unsigned long long start;
+	char *buffer, *map = NULL;
+	ssize_t ret = 0;
+	int fd;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0)
+		fail(path);
+	buffer = malloc(block);
+	if (!buffer)
+		fail("malloc");
+	memset(buffer, id, block);
+	for (i = 0; i < IOVS; i++) {
+		iov[i].iov_base = buffer + i * (block / IOVS);
+		iov[i].iov_len = i < IOVS - 1 ? block / IOVS : block - (IOVS - 1) * (block / IOVS);
+	}
+	if (method == MMAP) {
+		map = mmap(NULL, blocks * block, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED)
+			fail("mmap");
+	}
+	if (lseek(fd, pos * block, SEEK_SET) < 0)
+		fail("lseek");
+
+	pthread_barrier_wait(&barrier);
+	started[id] = now_ns();
+	for (i = 0; i < ops; i++) {
+		if (pos == blocks) {
+			pos = 0;
+			if (lseek(fd, 0, SEEK_SET) < 0)
+				fail("lseek");
+		}
+
+		start = now_ns();
+		switch (method) {
+		case READ:   ret = read(fd, buffer, block); break;
+		case WRITE:  ret = write(fd, buffer, block); break;
+		case PREAD:  ret = pread(fd, buffer, block, pos * block); break;
+		case PWRITE: ret = pwrite(fd, buffer, block, pos * block); break;
+		case READV:  ret = readv(fd, iov, IOVS); break;
+		case MMAP:   memcpy(buffer, map + pos * block, block); ret = block; break;
+		default:     break;
+		}
+		latencies[id][i] = now_ns() - start;
+		if (ret != (ssize_t)block)
+			fail(method_names[method]);
+		pos++;
+	}
+	finished[id] = now_ns();
+
+	if (map)
+		munmap(map, blocks * block);
+	free(buffer);
+	close(fd);
+	return NULL;
+}
+
+static int compare_ull(const void *a, const void *b) {
+	unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Run threads benchmark threads with the current method and block size; print GB/s over the
+ * time all of them took and latency percentiles of their operations
+ */
+static void bench_run(void) {
+	static const double percentiles[] = { 50, 99, 99.9 };
+	pthread_t thread_ids[MAX_THREADS];
+	unsigned long long *all, total, start, end;
+	double seconds;
+	unsigned int i, p;
+
+	ops = BYTES_PER_THREAD / block < max_ops ? BYTES_PER_THREAD / block : max_ops;
+	if (!ops)
+		ops = 1;
+	total = (unsigned long long)threads * ops;
+	all = malloc(total * sizeof(*all));
+	if (!all)
+		fail("malloc");
+	for (i = 0; i < threads; i++)
+		latencies[i] = all + i * ops;
+
+	// the threads start together, once all of them have opened and mapped the device
+	// pthread calls return the error rather than set errno
+	if ((errno = pthread_barrier_init(&barrier, NULL, threads)))
+		fail("pthread_barrier_init");
+	for (i = 0; i < threads; i++)
+		if ((errno = pthread_create(&thread_ids[i], NULL, bench_thread, (void *)(unsigned long)i)))
+			fail("pthread_create"); // threads already started wait at the barrier, exit ends them
+	for (i = 0; i < threads; i++)
+		pthread_join(thread_ids[i], NULL);
+	pthread_barrier_destroy(&barrier);
+	start = started[0];
+	end = finished[0];
+	for (i = 1; i < threads; i++) {
+		start = started[i] < start ? started[i] : start;
+		end = finished[i] > end ? finished[i] : end;
+	}
+	seconds = (end - start) / 1e9;
+
+	qsort(all, total, sizeof(*all), compare_ull);
+	printf("%-7s %8zu %7u %8.3f", method_names[method], block, threads, total * block / seconds / 1e9);
+	for (p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); p++)
+		printf(" %9.2f", all[(unsigned long long)(percentiles[p] / 100 * (total - 1))] / 1e3);
+	printf(" %9.2f\n", all[total - 1] / 1e3);
+	free(all);
+}
+
+/**
+ * @brief Sweep every access method over block sizes MIN_BLOCK .. max_block and 1 .. max_threads
+ * threads. Overwrites the device buffer
+ * @return 0 if successful
+ */
+static int benchmark(int fd) {
+	device_size = lseek(fd, 0, SEEK_END); // the device is a fixed size file of its buffer size
+	if (device_size < MIN_BLOCK) {
+		fprintf(stderr, "device buffer smaller than a %d byte block\n", MIN_BLOCK);
+		return -1;
+	}
+
+	printf("%-7s %8s %7s %8s %9s %9s %9s %9s\n", "method", "block", "threads", "GB/s", "p50 us", "p99 us",
+	       "p99.9 us", "max us");
+	for (method = 0; method < METHODS; method++)
+		for (block = MIN_BLOCK; block <= max_block && block <= (size_t)device_size; block *= 8)
+			for (threads = 1; threads <= max_threads; threads *= 2)
+				bench_run();
+	return 0;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-a] [-b [-s max block size] [-t max threads] [-n max ops per thread]] "
+	                "[/dev/char_dev_example0]\n", name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+	int ret, fd, opt, batch = 0, bench = 0;
 	char stringToSend[BUFFER_LENGTH];
-	printf("Starting device test code example...\n");
-	fd = open("/dev/char_dev_example", O_RDWR); // Open the device with read/write access
+
+	while ((opt = getopt(argc, argv, "abs:t:n:")) != -1) {
+		switch (opt) {
+		case 'a': batch = 1; break;
+		case 'b': bench = 1; break;
+		case 's': max_block = strtoul(optarg, NULL, 0); break;
+		case 't': max_threads = strtoul(optarg, NULL, 0); break;
+		case 'n': max_ops = strtoul(optarg, NULL, 0); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind < argc)
+		path = argv[optind];
+	if (max_threads < 1 || max_threads > MAX_THREADS || max_ops < 1) {
+		fprintf(stderr, "need 1 <= threads <= %d, ops >= 1\n", MAX_THREADS);
+		usage(argv[0]);
+	}
+
+	if (!bench)
+		printf("Starting device test code example...\n");
+	fd = open(path, O_RDWR);                   // Open the device with read/write access
 	if (fd < 0) {
-		perror("Failed to open the /dev/char_dev_example device...");
+		perror(path);
 		return errno;
 	}
+	if (batch)
+		return batch_test(fd) ? EXIT_FAILURE : EXIT_SUCCESS;
+	if (bench)
+		return benchmark(fd) ? EXIT_FAILURE : EXIT_SUCCESS;
+
 	printf("Type in a short string to send to the kernel module:\n");
 	scanf("%[^\n]%*c", stringToSend);          // Read in a string (with spaces)
 	printf("Writing message to the device [%s].\n", stringToSend);
-	ret = write(fd, stringToSend, strlen(stringToSend)); // Send the string to the LKM
+	ret = write(fd, stringToSend, strlen(stringToSend) + 1); // Send the string with its terminating 0 to the LKM
 	if (ret < 0) {
 		perror("Failed to write the message to the device.");
 		return errno;
@@ -40,7 +354,11 @@ int main() {
 	getchar();
 
 	printf("Reading from the device...\n");
-	ret = read(fd, receive, BUFFER_LENGTH);    // Read the response from the LKM
+	if (lseek(fd, 0, SEEK_SET) < 0) {         // The write moved the file offset past the string, go back to it
+		perror("Failed to seek the device.");
+		return errno;
+	}
+	ret = read(fd, receive, BUFFER_LENGTH - 1); // Read the string back from the LKM
 	if (ret < 0) {
 		perror("Failed to read the message from the device.");
 		return errno;
@@ -0,0 +1,569 @@
+/*
+ * classifier.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mateusz
+ *
+ *  Packet classification engines shared by the firewall kernel module and the userspace tools,
+ *  so that the tools run exactly the same matching code as the module does.
+ */
+
+#ifndef CLASSIFIER_H_
+#define CLASSIFIER_H_
+
+#include "common.h"
+
+#ifdef __KERNEL__
+// for firewall kernel module
+#include <linux/vmalloc.h>
+#define fw_alloc(size)	vmalloc(size)
+#define fw_free(ptr)	vfree(ptr)
+#else
+// for firewall userspace tools
+#include <cstdint>
+#include <cstdlib>
+#define fw_alloc(size)	malloc(size)
+#define fw_free(ptr)	free(ptr)
+#endif
+
+// no rule matched the packet
+#define NO_RULE_MATCHED (-1)
+
+// network packet as seen by the rules: addresses in host byte order, ports 0 if not tcp/udp
+typedef struct {
+	packet_direction in_out;
+	int ifindex;		// interface the packet came in or goes out through, 0 if unknown
+	const char *dev;	// and its name
+	unsigned int proto;
+	unsigned int src_ip;
+	unsigned int src_port;
+	unsigned int dest_ip;
+	unsigned int dest_port;
+} firewall_packet;
+
+/**
+ * @brief	Compare the two IP addresses, only the masked part.
+ * 			Netmask 0 means full compare, otherwise leading netmask ones are compared
+ */
+static inline bool ip_matches(unsigned int ip, unsigned int ip_rule, unsigned int mask) {
+	unsigned int cmp_len = 32;
+	unsigned int prefix;
+
+	if (mask != 0)
+		for (cmp_len = 0; cmp_len < 32 && (mask & (1u << (31 - cmp_len))); cmp_len++)
+			;
+
+	prefix = cmp_len ? ~0u << (32 - cmp_len) : 0;
+	return ((ip ^ ip_rule) & prefix) == 0;
+}
+
+/**
+ * @brief	Check if the rule applies to the packet
+ */
+static inline bool rule_matches(const firewall_rule *rule, const firewall_packet *pkt) {
+	if (rule->in_out != pkt->in_out)
+		return false;
+
+	if (rule->dev[0] && strcmp(rule->dev, pkt->dev) != 0)
+		return false;
+
+	if (rule->proto != PROTOCOL_ALL && (unsigned int)rule->proto != pkt->proto)
+		return false;
+
+	// ip 0 and port 0 mean the rule doesn't care
+	if (rule->src_ip != 0 && !ip_matches(pkt->src_ip, rule->src_ip, rule->src_netmask))
+		return false;
+
+	if (rule->dest_ip != 0 && !ip_matches(pkt->dest_ip, rule->dest_ip, rule->dest_netmask))
+		return false;
+
+	if (rule->src_port != 0 && rule->src_port != pkt->src_port)
+		return false;
+
+	if (rule->dest_port != 0 && rule->dest_port != pkt->dest_port)
+		return false;
+
+	return true;
+}
+
+/**
+ * @brief	Reference engine: walk the rules in order, first match wins
+ * @return	Index of the matching rule or NO_RULE_MATCHED
+ */
+static inline int classify_linear(const firewall_rule *rules, unsigned int count, const firewall_packet *pkt) {
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		if (rule_matches(&rules[i], pkt))
+			return i;
+
+	return NO_RULE_MATCHED;
+}
+
+
+/*
+ * Indexed engine.
+ * Rules are split into chains by direction and by the protocol of the packet they can match
+ * (a "tcp/udp" rule goes to every chain). Within a chain rules are bucketed by destination port;
+ * rules that don't care about destination port go to the wildcard bucket.
+ * Every bucket keeps its rules in policy order, so a packet only walks its port bucket
+ * and the wildcard bucket, and the lower rule index of the two first matches wins.
+ *
+ * Rules bound to an interface are indexed apart, one index per interface, see firewall_dispatch.
+ *
+ * Entries are stored as struct of arrays of pre-masked 32 bit words: a rule matches when
+ * ((packet word ^ rule word) & mask word) is 0 for all three words, so a block of entries
+ * is tested with no branches and few cache lines, in a loop the compiler can vectorize.
+ */
+#define FW_PORT_BUCKETS	64	// power of 2
+#define FW_WILD_BUCKET	FW_PORT_BUCKETS
+#define FW_DIRECTION_COUNT 2
+#define FW_SCAN_BLOCK	16	// entries tested at once, arrays are padded so a block never reads past them
+enum {FW_CHAIN_TCP = 0, FW_CHAIN_UDP = 1, FW_CHAIN_OTHER = 2, FW_CHAIN_COUNT = 3};
+
+// packed rule as the packet path sees it; prefix length 0 means any address
+typedef struct {
+	uint32_t src_ip;	// masked with the prefix
+	uint32_t dest_ip;
+	uint16_t src_port;
+	uint16_t dest_port;
+	uint8_t src_prefix;
+	uint8_t dest_prefix;
+	uint8_t proto;
+	uint8_t in_out;
+	uint8_t action;
+} firewall_rule_key;
+
+// entries of bucket b are entries offset[b] .. offset[b + 1] - 1
+typedef struct {
+	unsigned int offset[FW_PORT_BUCKETS + 2];
+} firewall_chain;
+
+typedef struct {
+	firewall_chain chains[FW_DIRECTION_COUNT][FW_CHAIN_COUNT];
+	unsigned int entry_count;
+	// entries, one array per field; direction and protocol are implied by the chain
+	uint32_t *src_ip;
+	uint32_t *src_mask;
+	uint32_t *dest_ip;
+	uint32_t *dest_mask;
+	uint32_t *ports;		// src_port << 16 | dest_port
+	uint32_t *port_mask;
+	uint32_t *rule;			// position of the entry's rule in the policy
+} firewall_index;
+
+static inline int direction_slot(packet_direction in_out) {
+	return in_out == DIRECTION_INCOMING ? 0 : in_out == DIRECTION_OUTGOING ? 1 : -1;
+}
+
+static inline unsigned int packet_chain(unsigned int proto) {
+	return proto == PROTOCOL_TCP ? FW_CHAIN_TCP : proto == PROTOCOL_UDP ? FW_CHAIN_UDP : FW_CHAIN_OTHER;
+}
+
+static inline bool rule_in_chain(const firewall_rule *rule, unsigned int chain) {
+	switch (rule->proto) {
+	case PROTOCOL_TCP:
+		return chain == FW_CHAIN_TCP;
+	case PROTOCOL_UDP:
+		return chain == FW_CHAIN_UDP;
+	default:
+		return true;
+	}
+}
+
+static inline unsigned int port_bucket(unsigned int dest_port) {
+	return dest_port == 0 ? FW_WILD_BUCKET : dest_port & (FW_PORT_BUCKETS - 1);
+}
+
+/**
+ * @brief	Check if the rule can be indexed at all; rules that can't never match a packet
+ */
+static inline bool rule_indexable(const firewall_rule *rule) {
+	return direction_slot(rule->in_out) >= 0 && rule->src_port <= 0xffff && rule->dest_port <= 0xffff;
+}
+
+static inline uint32_t prefix_mask(unsigned int prefix) {
+	return prefix ? ~0u << (32 - prefix) : 0;
+}
+
+/**
+ * @brief	Number of leading netmask ones compared by ip_matches, 0 if the rule doesn't care about the address
+ */
+static inline unsigned int rule_prefix(unsigned int ip, unsigned int mask) {
+	unsigned int prefix;
+
+	if (ip == 0)
+		return 0;
+	if (mask == 0)
+		return 32;
+	for (prefix = 0; prefix < 32 && (mask & (1u << (31 - prefix))); prefix++)
+		;
+	return prefix;
+}
+
+static inline bool rule_on_dev(const firewall_rule *rule, const char *dev) {
+	return strncmp(rule->dev, dev, DEV_NAME_LENGTH) == 0;
+}
+
+/**
+ * @brief	Pack rule for the packet path
+ */
+static inline void rule_key_pack(const firewall_rule *rule, firewall_rule_key *key) {
+	key->src_prefix = rule_prefix(rule->src_ip, rule->src_netmask);
+	key->dest_prefix = rule_prefix(rule->dest_ip, rule->dest_netmask);
+	key->src_ip = rule->src_ip & prefix_mask(key->src_prefix);
+	key->dest_ip = rule->dest_ip & prefix_mask(key->dest_prefix);
+	key->src_port = rule->src_port;
+	key->dest_port = rule->dest_port;
+	key->proto = rule->proto;
+	key->in_out = rule->in_out;
+	key->action = rule->action;
+}
+
+/**
+ * @brief	Release memory held by the index
+ */
+static inline void firewall_index_free(firewall_index *idx) {
+	fw_free(idx->src_ip); // all entry arrays live in one allocation
+	idx->src_ip = NULL;
+	idx->entry_count = 0;
+}
+
+/**
+ * @brief	Allocate arrays for given number of entries; the chains are left to the caller
+ * @return	True on success, False if out of memory
+ */
+static inline bool firewall_index_alloc(firewall_index *idx, unsigned int entry_count) {
+	size_t padded = entry_count + FW_SCAN_BLOCK;
+
+	idx->entry_count = entry_count;
+	idx->src_ip = (uint32_t *) fw_alloc(sizeof(uint32_t) * 7 * padded);
+	if (!idx->src_ip) {
+		idx->entry_count = 0;
+		return false;
+	}
+
+	// padding entries must exist but never count as a match, see index_scan_block
+	memset(idx->src_ip, 0, sizeof(uint32_t) * 7 * padded);
+	idx->src_mask = idx->src_ip + padded;
+	idx->dest_ip = idx->src_mask + padded;
+	idx->dest_mask = idx->dest_ip + padded;
+	idx->ports = idx->dest_mask + padded;
+	idx->port_mask = idx->ports + padded;
+	idx->rule = idx->port_mask + padded;
+	return true;
+}
+
+/**
+ * @brief	Store packed rule at given policy position as index entry e
+ */
+static inline void firewall_index_set_entry(firewall_index *idx, unsigned int e, unsigned int rule, const firewall_rule_key *key) {
+	idx->src_ip[e] = key->src_ip;
+	idx->src_mask[e] = prefix_mask(key->src_prefix);
+	idx->dest_ip[e] = key->dest_ip;
+	idx->dest_mask[e] = prefix_mask(key->dest_prefix);
+	idx->ports[e] = (uint32_t) key->src_port << 16 | key->dest_port;
+	idx->port_mask[e] = (key->src_port ? 0xffff0000u : 0) | (key->dest_port ? 0xffffu : 0);
+	idx->rule[e] = rule;
+}
+
+/**
+ * @brief	Build the index of the rules bound to interface dev ("" - of the rules for any interface),
+ * 			out of all rules given in policy order and their packed keys
+ * @return	True on success, False if out of memory
+ */
+static inline bool firewall_index_build(firewall_index *idx, const firewall_rule *rules, const firewall_rule_key *keys,
+										unsigned int count, const char *dev) {
+	unsigned int *fill;
+	unsigned int i, d, c, b, total = 0;
+	int slot;
+
+	memset(idx, 0, sizeof(*idx));
+
+	// count rules per bucket (in offset[b + 1] for now)
+	for (i = 0; i < count; i++) {
+		if (!rule_indexable(&rules[i]) || !rule_on_dev(&rules[i], dev))
+			continue; // never matches or not in this index
+		slot = direction_slot(rules[i].in_out);
+		for (c = 0; c < FW_CHAIN_COUNT; c++)
+			if (rule_in_chain(&rules[i], c))
+				idx->chains[slot][c].offset[port_bucket(rules[i].dest_port) + 1]++;
+	}
+
+	// turn counts into absolute offsets; chains are laid out one after another
+	for (d = 0; d < FW_DIRECTION_COUNT; d++)
+		for (c = 0; c < FW_CHAIN_COUNT; c++) {
+			idx->chains[d][c].offset[0] = total;
+			for (b = 1; b <= FW_WILD_BUCKET + 1; b++) {
+				total += idx->chains[d][c].offset[b];
+				idx->chains[d][c].offset[b] = total;
+			}
+		}
+
+	fill = (unsigned int *) fw_alloc(sizeof(idx->chains));
+	if (!fill || !firewall_index_alloc(idx, total)) {
+		fw_free(fill);
+		return false;
+	}
+
+	// fill buckets in policy order so each bucket stays sorted by rule index
+	memcpy(fill, idx->chains, sizeof(idx->chains));
+	for (i = 0; i < count; i++) {
+		if (!rule_indexable(&rules[i]) || !rule_on_dev(&rules[i], dev))
+			continue;
+		slot = direction_slot(rules[i].in_out);
+		for (c = 0; c < FW_CHAIN_COUNT; c++) {
+			if (!rule_in_chain(&rules[i], c))
+				continue;
+			b = port_bucket(rules[i].dest_port);
+			firewall_index_set_entry(idx, fill[(slot * FW_CHAIN_COUNT + c) * (FW_PORT_BUCKETS + 2) + b]++, i, &keys[i]);
+		}
+	}
+
+	fw_free(fill);
+	return true;
+}
+
+/**
+ * @brief	Test the block of entries starting at first, only entries below last count
+ * @return	Position of the first matching entry or NO_RULE_MATCHED
+ */
+static inline int index_scan_block(const firewall_index *idx, unsigned int first, unsigned int last,
+								   const firewall_packet *pkt) {
+	uint32_t ports = pkt->src_port << 16 | (pkt->dest_port & 0xffff);
+	unsigned int hits = 0;
+	unsigned int i;
+
+	for (i = 0; i < FW_SCAN_BLOCK; i++) {
+		uint32_t miss = ((pkt->src_ip ^ idx->src_ip[first + i]) & idx->src_mask[first + i]) |
+						((pkt->dest_ip ^ idx->dest_ip[first + i]) & idx->dest_mask[first + i]) |
+						((ports ^ idx->ports[first + i]) & idx->port_mask[first + i]);
+		hits |= (unsigned int) (miss == 0) << i;
+	}
+
+	if (last - first < FW_SCAN_BLOCK)
+		hits &= (1u << (last - first)) - 1;
+
+	return hits ? (int) (first + __builtin_ctz(hits)) : NO_RULE_MATCHED;
+}
+
+/**
+ * @brief	Look the packet up in one index, regardless of its interface
+ * @return	Index of the matching rule or NO_RULE_MATCHED
+ */
+static inline int classify_indexed(const firewall_index *idx, const firewall_packet *pkt) {
+	const firewall_chain *chain;
+	unsigned int port_next, port_end, wild_next, wild_end, best = ~0u;
+	unsigned int *next, end;
+	int slot, hit;
+
+	if ((slot = direction_slot(pkt->in_out)) < 0)
+		return NO_RULE_MATCHED;
+
+	chain = &idx->chains[slot][packet_chain(pkt->proto)];
+	port_next = chain->offset[pkt->dest_port & (FW_PORT_BUCKETS - 1)];
+	port_end = chain->offset[(pkt->dest_port & (FW_PORT_BUCKETS - 1)) + 1];
+	wild_next = chain->offset[FW_WILD_BUCKET];
+	wild_end = chain->offset[FW_WILD_BUCKET + 1];
+
+	// walk both buckets a block at a time, always the one behind in policy order,
+	// until the blocks left start past the best match found
+	for (;;) {
+		if (port_next < port_end && (wild_next == wild_end || idx->rule[port_next] < idx->rule[wild_next])) {
+			next = &port_next;
+			end = port_end;
+		} else if (wild_next < wild_end) {
+			next = &wild_next;
+			end = wild_end;
+		} else {
+			break;
+		}
+
+		if (idx->rule[*next] >= best)
+			break;
+
+		hit = index_scan_block(idx, *next, end, pkt);
+		if (hit != NO_RULE_MATCHED) {
+			if (idx->rule[hit] < best)
+				best = idx->rule[hit];
+			*next = end; // later entries of this bucket are later in the policy
+		} else {
+			*next = end - *next > FW_SCAN_BLOCK ? *next + FW_SCAN_BLOCK : end;
+		}
+	}
+
+	return best == ~0u ? NO_RULE_MATCHED : (int) best;
+}
+
+/*
+ * Per-interface dispatch: the rules for any interface make the global index, the rules bound to
+ * an interface make that interface's index. A packet is looked up in the global index and in the
+ * index of its interface only, the lower rule index wins. Indexes refer to interfaces by name;
+ * firewall_dispatch_resolve maps the names to the ifindexes packets carry and hashes the ifindexes
+ * into an open addressing table, so finding the index of a packet's interface takes a probe or two
+ * however many interfaces the rules name.
+ */
+typedef struct {
+	char dev[DEV_NAME_LENGTH];
+	int ifindex;	// of the interface named dev, 0 if there is no such interface
+	firewall_index index;
+} firewall_dev_index;
+
+typedef struct {
+	unsigned int rule_count;
+	firewall_rule_key *keys;	// packed rules in policy order
+	firewall_index global;
+	unsigned int dev_count;
+	firewall_dev_index *devs;
+	unsigned int dev_slot_mask;	// slot count - 1, the slot count is a power of two above twice dev_count
+	unsigned int *dev_slots;	// devs position + 1 of the resolved interface hashed there, 0 if empty
+} firewall_dispatch;
+
+/**
+ * @brief	Release memory held by the dispatch and its indexes
+ */
+static inline void firewall_dispatch_free(firewall_dispatch *fd) {
+	unsigned int i;
+
+	for (i = 0; i < fd->dev_count; i++)
+		firewall_index_free(&fd->devs[i].index);
+	firewall_index_free(&fd->global);
+	fw_free(fd->dev_slots);
+	fw_free(fd->devs);
+	fw_free(fd->keys);
+	fd->dev_slots = NULL;
+	fd->devs = NULL;
+	fd->keys = NULL;
+	fd->dev_count = 0;
+	fd->rule_count = 0;
+}
+
+/**
+ * @brief	Allocate packed keys for given number of rules and room for given number of interface indexes
+ * @return	True on success, False if out of memory
+ */
+static inline bool firewall_dispatch_alloc(firewall_dispatch *fd, unsigned int rule_count, unsigned int dev_count) {
+	unsigned int slots = 2;
+
+	memset(fd, 0, sizeof(*fd));
+	while (slots <= 2 * dev_count)
+		slots *= 2;
+	fd->dev_slot_mask = slots - 1;
+	fd->keys = (firewall_rule_key *) fw_alloc(sizeof(firewall_rule_key) * (rule_count ? rule_count : 1));
+	fd->devs = (firewall_dev_index *) fw_alloc(sizeof(firewall_dev_index) * (dev_count ? dev_count : 1));
+	fd->dev_slots = (unsigned int *) fw_alloc(sizeof(unsigned int) * slots);
+	if (!fd->keys || !fd->devs || !fd->dev_slots) {
+		firewall_dispatch_free(fd);
+		return false;
+	}
+
+	memset(fd->devs, 0, sizeof(firewall_dev_index) * (dev_count ? dev_count : 1));
+	memset(fd->dev_slots, 0, sizeof(unsigned int) * slots);
+	fd->rule_count = rule_count;
+	return true;
+}
+
+/**
+ * @brief	Build the global index and an index per interface out of rules given in policy order.
+ * 			Interfaces are left unresolved
+ * @return	True on success, False if out of memory
+ */
+static inline bool firewall_dispatch_build(firewall_dispatch *fd, const firewall_rule *rules, unsigned int count) {
+	const char **devs; // distinct interface names, in order of their first rule
+	unsigned int i, j, dev_count = 0;
+	bool built = false;
+
+	devs = (const char **) fw_alloc(sizeof(*devs) * (count ? count : 1));
+	if (!devs)
+		return false;
+
+	for (i = 0; i < count; i++) {
+		if (!rules[i].dev[0])
+			continue;
+		for (j = 0; j < dev_count && !rule_on_dev(&rules[i], devs[j]); j++)
+			;
+		if (j == dev_count)
+			devs[dev_count++] = rules[i].dev;
+	}
+
+	if (!firewall_dispatch_alloc(fd, count, dev_count))
+		goto out;
+
+	for (i = 0; i < count; i++)
+		rule_key_pack(&rules[i], &fd->keys[i]);
+
+	if (!firewall_index_build(&fd->global, rules, fd->keys, count, ""))
+		goto out;
+
+	for (; fd->dev_count < dev_count; fd->dev_count++) {
+		memcpy(fd->devs[fd->dev_count].dev, devs[fd->dev_count], DEV_NAME_LENGTH);
+		if (!firewall_index_build(&fd->devs[fd->dev_count].index, rules, fd->keys, count, devs[fd->dev_count]))
+			goto out;
+	}
+	built = true;
+
+out:
+	if (!built)
+		firewall_dispatch_free(fd);
+	fw_free(devs);
+	return built;
+}
+
+/**
+ * @brief	Slot of the ifindex hash table to start probing at; ifindexes are mostly small and dense,
+ * 			so the low bits spread them well
+ */
+static inline unsigned int dev_slot(const firewall_dispatch *fd, int ifindex) {
+	return (unsigned int) ifindex & fd->dev_slot_mask;
+}
+
+/**
+ * @brief	Map interface names of the indexes to ifindexes with given function, 0 means no such interface,
+ * 			and hash the resolved ones for classify_dispatch. Must not run on a dispatch in use
+ */
+static inline void firewall_dispatch_resolve(firewall_dispatch *fd, int (*ifindex_of)(const char *dev)) {
+	unsigned int i, slot;
+
+	memset(fd->dev_slots, 0, sizeof(unsigned int) * (fd->dev_slot_mask + 1));
+	for (i = 0; i < fd->dev_count; i++) {
+		fd->devs[i].ifindex = ifindex_of(fd->devs[i].dev);
+		if (!fd->devs[i].ifindex)
+			continue;
+		for (slot = dev_slot(fd, fd->devs[i].ifindex); fd->dev_slots[slot]; slot = (slot + 1) & fd->dev_slot_mask)
+			;
+		fd->dev_slots[slot] = i + 1;
+	}
+}
+
+/**
+ * @brief	Find the index of the interface with given ifindex
+ * @return	The index, NULL if no resolved interface has rules of its own
+ */
+static inline const firewall_index *firewall_dispatch_dev(const firewall_dispatch *fd, int ifindex) {
+	unsigned int slot, dev;
+
+	for (slot = dev_slot(fd, ifindex); (dev = fd->dev_slots[slot]); slot = (slot + 1) & fd->dev_slot_mask)
+		if (fd->devs[dev - 1].ifindex == ifindex)
+			return &fd->devs[dev - 1].index;
+	return NULL;
+}
+
+/**
+ * @brief	Indexed engine: same result as classify_linear on the rules the dispatch was built from,
+ * 			provided the packet's ifindex and interface name agree with the resolved interfaces
+ * @return	Index of the matching rule or NO_RULE_MATCHED
+ */
+static inline int classify_dispatch(const firewall_dispatch *fd, const firewall_packet *pkt) {
+	int match = classify_indexed(&fd->global, pkt), dev_match;
+	const firewall_index *dev_index;
+
+	if (!pkt->ifindex || !(dev_index = firewall_dispatch_dev(fd, pkt->ifindex)))
+		return match;
+
+	dev_match = classify_indexed(dev_index, pkt);
+	if (dev_match != NO_RULE_MATCHED && (match == NO_RULE_MATCHED || dev_match < match))
+		match = dev_match;
+	return match;
+}
+
+#endif /* CLASSIFIER_H_ */
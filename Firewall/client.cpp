@@ -6,9 +6,16 @@
  */
 
 #include "common.h"
+#include "rules_file.h"
+#include "ruleset_image.h"
 #include <fstream>
 #include <iostream>
 #include <algorithm>
+#include <chrono>
+#include <unordered_map>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace std;
 
@@ -17,11 +24,13 @@ using namespace std;
  * @brief	Cut and return single token from src string (tokens are separated by spaces)
  */
 string cut_token(string &src) {
-	char head[25] = {'\0'};
-	char tail[100] = {'\0'};
+	const char *SPACES = " \t\r\n";
+	size_t head_begin = src.find_first_not_of(SPACES);
+	size_t head_end = src.find_first_of(SPACES, head_begin);
+	size_t tail_begin = src.find_first_not_of(SPACES, head_end);
 
-	sscanf(src.c_str(), "%s %[^\n]%*c", head, tail);
-	src = tail;
+	string head = (head_begin == string::npos) ? "" : src.substr(head_begin, head_end - head_begin);
+	src = (tail_begin == string::npos) ? "" : src.substr(tail_begin);
 	return head;
 }
 
@@ -44,11 +53,12 @@ fstream get_module_stream() {
  * @brief	Print all currently active firewall rules to stdout
  */
 void print_firewall_rules() {
-	if (fstream stream = get_module_stream())
+	if (fstream stream = get_module_stream()) {
 		if (stream.peek() != std::ifstream::traits_type::eof())
 			cout << stream.rdbuf();
 		else
 			cout << "[no rules]" << endl;
+	}
 }
 
 /**
@@ -81,6 +91,230 @@ void del_firewall_rule(const string &rule_number_string) {
 		stream << "del " << rule_number;
 }
 
+/**
+ * @name	compile_ruleset
+ * @brief	Compile rules file into binary ruleset image the module can load at init (ruleset=<image> parameter)
+ */
+void compile_ruleset(string args) {
+	string rules_filename = cut_token(args);
+	string image_filename = cut_token(args);
+	vector<firewall_rule> rules;
+	firewall_dispatch dispatch;
+	void *image = nullptr;
+	size_t image_size = 0;
+	const char *error;
+
+	if (rules_filename.empty() || image_filename.empty()) {
+		cout << "Usage: compile <rules file> <image file>" << endl;
+		return;
+	}
+
+	if (!load_rules_file(rules_filename, rules))
+		return;
+
+	if (!firewall_dispatch_build(&dispatch, rules.data(), rules.size())) {
+		cout << "Out of memory building the index" << endl;
+		return;
+	}
+
+	error = ruleset_image_write(rules.data(), rules.size(), &dispatch, &image, &image_size);
+	firewall_dispatch_free(&dispatch);
+	if (error) {
+		cout << "Can't compile ruleset: " << error << endl;
+		return;
+	}
+
+	ofstream image_file(image_filename, ios::binary | ios::trunc);
+	if (!image_file.write((const char *) image, image_size))
+		cout << "Can't write image file: " << image_filename << endl;
+	else
+		cout << "Compiled " << rules.size() << " rules into " << image_filename << " (" << image_size << " bytes)" << endl;
+	fw_free(image);
+}
+
+struct rule_hash {
+	size_t operator()(const firewall_rule &r) const {
+		size_t h = 0;
+		for (unsigned int field : {(unsigned int) r.in_out, r.src_ip, r.src_netmask, r.src_port, r.dest_ip,
+								   r.dest_netmask, r.dest_port, (unsigned int) r.proto, (unsigned int) r.action})
+			h = h * 1000003 ^ field;
+		return h ^ std::hash<string>()(r.dev);
+	}
+};
+
+struct rule_equal {
+	bool operator()(const firewall_rule &a, const firewall_rule &b) const {
+		return a.in_out == b.in_out && a.src_ip == b.src_ip && a.src_netmask == b.src_netmask && a.src_port == b.src_port &&
+			   a.dest_ip == b.dest_ip && a.dest_netmask == b.dest_netmask && a.dest_port == b.dest_port &&
+			   a.proto == b.proto && a.action == b.action && strcmp(a.dev, b.dev) == 0;
+	}
+};
+
+/**
+ * @name	read_firewall_rules
+ * @brief	Read rules currently active in the module, in list order, and the version of that list
+ * @return	True on success
+ */
+bool read_firewall_rules(vector<firewall_rule> &rules, unsigned int &version) {
+	const string RULES_FILEPATH = "/proc/" PROCFS_RULES_FILENAME;
+	ifstream stream(RULES_FILEPATH);
+	string line;
+	firewall_rule rule;
+
+	if (!stream) {
+		cout << "firewall module not running; rules file doesnt exists: " << RULES_FILEPATH << endl;
+		return false;
+	}
+
+	if (!getline(stream, line) || sscanf(line.c_str(), RULES_VERSION_FORMAT, &version) != 1) {
+		cout << "Unexpected rules version line from the module: " << line << endl;
+		return false;
+	}
+
+	while (getline(stream, line)) {
+		if (!deserialize_rule(line.c_str(), &rule)) {
+			cout << "Unexpected rule from the module: " << line << endl;
+			return false;
+		}
+		rules.push_back(rule);
+	}
+	return true;
+}
+
+/**
+ * @name	diff_rules
+ * @brief	Build batch that turns current rule list into the desired one, for the module to apply at once.
+ * 			Rules found in both lists in the same relative order (longest increasing run of their current
+ * 			positions) are kept, other current rules are deleted, other desired rules are inserted right
+ * 			after the kept rule preceding them, so the first-match order comes out exactly as desired
+ * @return	Batch text, without the "batch" header line
+ */
+string diff_rules(const vector<firewall_rule> &current, const vector<firewall_rule> &desired,
+				  unsigned int &inserted, unsigned int &deleted) {
+	unordered_map<firewall_rule, unsigned int, rule_hash, rule_equal> first_unused;	// 1-based current rule number
+	vector<unsigned int> next_same(current.size() + 1, 0);	// next current rule number with identical rule
+	vector<unsigned int> matched(desired.size(), 0);	// current rule number of desired rule, 0 if new
+	vector<bool> keep_desired(desired.size(), false);
+	vector<bool> keep_current(current.size() + 1, false);
+
+	// pair every desired rule with an unused identical current rule
+	first_unused.reserve(current.size());
+	for (size_t i = current.size(); i > 0; i--) {
+		unsigned int &first = first_unused[current[i - 1]];
+		next_same[i] = first;
+		first = i;
+	}
+
+	for (size_t j = 0; j < desired.size(); j++) {
+		auto it = first_unused.find(desired[j]);
+		if (it != first_unused.end() && it->second) {
+			matched[j] = it->second;
+			it->second = next_same[it->second];
+		}
+	}
+
+	// longest increasing subsequence of matched current numbers, in desired order (patience sorting)
+	vector<size_t> tails;						// desired index ending the best run of each length
+	vector<long> previous(desired.size(), -1);	// desired index before this one in its run
+	for (size_t j = 0; j < desired.size(); j++) {
+		if (!matched[j])
+			continue;
+		auto pos = lower_bound(tails.begin(), tails.end(), matched[j],
+							   [&](size_t t, unsigned int number) { return matched[t] < number; });
+		if (pos != tails.begin())
+			previous[j] = *(pos - 1);
+		if (pos == tails.end())
+			tails.push_back(j);
+		else
+			*pos = j;
+	}
+	for (long j = tails.empty() ? -1 : tails.back(); j >= 0; j = previous[j]) {
+		keep_desired[j] = true;
+		keep_current[matched[j]] = true;
+	}
+
+	string batch;
+	char rule_string[MAX_RULE_STRING_LENGTH];
+	inserted = deleted = 0;
+
+	for (size_t i = 1; i <= current.size(); i++)
+		if (!keep_current[i]) {
+			batch += "del " + to_string(i) + "\n";
+			deleted++;
+		}
+
+	unsigned int after = 0;
+	for (size_t j = 0; j < desired.size(); j++) {
+		if (keep_desired[j]) {
+			after = matched[j];
+			continue;
+		}
+		serialize_rule(&desired[j], rule_string);
+		batch += "ins " + to_string(after) + " " + rule_string + "\n";
+		inserted++;
+	}
+	return batch;
+}
+
+/**
+ * @name	sync_firewall_rules
+ * @brief	Make the module rules exactly those of the rules file, with minimal changes applied at once.
+ * 			The batch names the rules version it was diffed against; if the rules changed meanwhile
+ * 			the module refuses it with EAGAIN and the diff is made again
+ */
+void sync_firewall_rules(string args) {
+	const string COMMUNICATION_FILEPATH = "/proc/" PROCFS_FILENAME;
+	const int MAX_ATTEMPTS = 5;
+	string rules_filename = cut_token(args);
+	vector<firewall_rule> desired, current;
+	unsigned int inserted, deleted, version;
+	char header[32];
+	ssize_t written;
+
+	if (rules_filename.empty()) {
+		cout << "Usage: sync <rules file>" << endl;
+		return;
+	}
+
+	auto start = chrono::steady_clock::now();
+	if (!load_rules_file(rules_filename, desired))
+		return;
+
+	for (int attempt = 1; ; attempt++) {
+		current.clear();
+		if (!read_firewall_rules(current, version))
+			return;
+
+		string batch = diff_rules(current, desired, inserted, deleted);
+		if (batch.empty()) {
+			cout << "Already in sync, " << current.size() << " rules" << endl;
+			return;
+		}
+
+		// single write so the module applies the whole batch at once
+		snprintf(header, sizeof(header), BATCH_HEADER_FORMAT, version);
+		batch = header + batch;
+		int fd = open(COMMUNICATION_FILEPATH.c_str(), O_WRONLY);
+		if (fd < 0) {
+			cout << "firewall module not running; communication file doesnt exists: " << COMMUNICATION_FILEPATH << endl;
+			return;
+		}
+		written = write(fd, batch.data(), batch.size());
+		int write_errno = errno;
+		close(fd);
+		if (written == (ssize_t) batch.size())
+			break;
+		if (written < 0 && write_errno == EAGAIN && attempt < MAX_ATTEMPTS)
+			continue; // rules changed since they were read
+		cout << "Module rejected the batch, rules unchanged" << endl;
+		return;
+	}
+
+	double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	cout << "Synced " << desired.size() << " rules: " << inserted << " added, " << deleted << " deleted, "
+		 << desired.size() - inserted << " kept in " << ms << " ms" << endl;
+}
+
 /**
  * @name	print_help
  * @brief	Print available commands to stdout
@@ -90,7 +324,11 @@ void print_help() {
 	cout << "\texit\n";
 	cout << "\tprint\n";
 	cout << "\tadd tcp out block anyip anyip 0 anyip anyip 22 [block outgoing ssh packets]\n";
+	cout << "\tadd all in block 10.1.2.3 anyip 0 anyip anyip 0 ttl 60 [block a source for a minute]\n";
+	cout << "\tadd tcp in unblock anyip anyip 0 anyip anyip 22 dev eth1 [only the rules of the packet's interface apply]\n";
 	cout << "\tdel 2\n";
+	cout << "\tcompile rules.txt firewall.img [rules.txt holds one add command per line]\n";
+	cout << "\tsync rules.txt [make active rules exactly those of rules.txt]\n";
 	cout << endl;
 }
 
@@ -110,6 +348,10 @@ bool parse(string line) {
 		add_firewall_rule(line);
 	else if (cmd ==  "del")
 		del_firewall_rule(line);
+	else if (cmd == "compile")
+		compile_ruleset(line);
+	else if (cmd == "sync")
+		sync_firewall_rules(line);
 	else
 		print_help();
 
@@ -117,11 +359,18 @@ bool parse(string line) {
 }
 
 /**
- * Program entry point
+ * Program entry point. Commands given as arguments are run without the prompt, eg. "client print"
  */
 int main(int argc, char *argv[]) {
 	string line;
 
+	if (argc > 1) {
+		for (int i = 1; i < argc; i++)
+			line += string(argv[i]) + " ";
+		parse(line);
+		return 0;
+	}
+
 	cout << "Firewall client v0.1" << endl;
 	do {
 		cout << "> ";
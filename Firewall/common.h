@@ -21,6 +21,14 @@
 
 // firewall module communication file is /proc/firewall
 #define PROCFS_FILENAME "firewall"
+// rules in deserialize_rule syntax, one per line, for the client to read back
+#define PROCFS_RULES_FILENAME "firewall_rules"
+// first line of the rules file; a batch names the version its rule numbers refer to
+#define RULES_VERSION_FORMAT "# version %u\n"
+#define BATCH_HEADER_FORMAT "batch %u\n"
+#define MAX_RULE_STRING_LENGTH 160
+// interface name length including the terminating 0, as IFNAMSIZ
+#define DEV_NAME_LENGTH 16
 #define	ANY_IP "anyip"
 
 // enums related to firwall_rule
@@ -41,6 +49,8 @@ typedef struct {
 	unsigned int dest_port;
 	protocol_type proto;
 	action_type action;
+	unsigned int ttl;	// seconds the rule stays active, 0 - until deleted
+	char dev[DEV_NAME_LENGTH];	// interface the rule applies to, "" - any
 } firewall_rule;
 
 /**
@@ -87,37 +97,85 @@ unsigned int ip_str_to_hl(char *ip_str) {
 	return ip;
 }
 
+/**
+ * @brief	Convert host long integer ip to string, 0 becomes ANY_IP
+ */
+void ip_hl_to_str(unsigned int ip, char *ip_str) {
+	if (ip == 0)
+		strcpy(ip_str, ANY_IP);
+	else
+		sprintf(ip_str, "%u.%u.%u.%u", ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff);
+}
+
+/**
+ * @brief 	Serialize a rule into string that deserialize_rule turns back into the same rule
+ * @param	out_rule_string At least MAX_RULE_STRING_LENGTH long
+ * @return	Length of the string
+ */
+int serialize_rule(const firewall_rule *rule, char *out_rule_string) {
+	char src_ip[16], src_mask[16], dst_ip[16], dst_mask[16];
+	int length;
+
+	ip_hl_to_str(rule->src_ip, src_ip);
+	ip_hl_to_str(rule->src_netmask, src_mask);
+	ip_hl_to_str(rule->dest_ip, dst_ip);
+	ip_hl_to_str(rule->dest_netmask, dst_mask);
+
+	length = sprintf(out_rule_string, "%s %s %s %s %s %u %s %s %u",
+				rule->proto == PROTOCOL_TCP ? "tcp" : rule->proto == PROTOCOL_UDP ? "udp" : "all",
+				rule->in_out == DIRECTION_INCOMING ? "in" : rule->in_out == DIRECTION_OUTGOING ? "out" : "none",
+				rule->action == ACTION_BLOCK ? "block" : "unblock",
+				src_ip, src_mask, rule->src_port, dst_ip, dst_mask, rule->dest_port);
+	if (rule->ttl)
+		length += sprintf(out_rule_string + length, " ttl %u", rule->ttl);
+	if (rule->dev[0])
+		length += sprintf(out_rule_string + length, " dev %s", rule->dev);
+	return length;
+}
+
 /**
  * @brief 	Deserialize a rule from given string
- * @param	rule_string "protocol direction action srcip srcmask srcport dstip dstmask dstport"
+ * @param	rule_string "protocol direction action srcip srcmask srcport dstip dstmask dstport [ttl seconds] [dev interface]"
  * @return	True o successful deserialization, False otherwise
  */
 bool deserialize_rule(const char* rule_string, firewall_rule *out_rule) {
 
-	char protocol[15] = {'\0'};		// tcp/udp/all
-	char direction[15] = {'\0'};	// in/out
-	char action[15] = {'\0'};		// block/unblock
+	char protocol[16] = {'\0'};		// tcp/udp/all
+	char direction[16] = {'\0'};	// in/out
+	char action[16] = {'\0'};		// block/unblock
 
-	char src_ip[15] = {'\0'};
-	char src_mask[15] = {'\0'};
+	char src_ip[16] = {'\0'};
+	char src_mask[16] = {'\0'};
 	unsigned int src_port;
 
-	char dst_ip[15] = {'\0'};
-	char dst_mask[15] = {'\0'};
+	char dst_ip[16] = {'\0'};
+	char dst_mask[16] = {'\0'};
 	unsigned int dst_port;
-	int num_retrieved;
+	unsigned int ttl = 0;
+	char dev[DEV_NAME_LENGTH] = {'\0'};
+	int num_retrieved, consumed = 0;
 
 	// check for null rule string
 	if (!rule_string)
 		return false;
 
-	num_retrieved = sscanf(rule_string, "%s %s %s %s %s %u %s %s %u",
-							protocol, direction, action, src_ip, src_mask, &src_port, dst_ip, dst_mask, &dst_port);
+	num_retrieved = sscanf(rule_string, "%15s %15s %15s %15s %15s %u %15s %15s %u %n",
+							protocol, direction, action, src_ip, src_mask, &src_port, dst_ip, dst_mask, &dst_port, &consumed);
 
 	// check all arguments were retrieved from rule string
 	if (num_retrieved < 9)
 		return false;
 
+	// optional settings, in any order
+	for (rule_string += consumed; *rule_string; rule_string += consumed) {
+		consumed = 0;
+		if (sscanf(rule_string, "ttl %u %n", &ttl, &consumed) == 1 && ttl != 0 && consumed)
+			continue;
+		if (sscanf(rule_string, "dev %15s %n", dev, &consumed) == 1 && consumed)
+			continue;
+		return false;
+	}
+
 	#define CHECK_OP(op1, op2) ((strcmp(op1, op2) == 0))
 	out_rule->proto = CHECK_OP(protocol, "tcp") ? PROTOCOL_TCP : CHECK_OP(protocol, "udp") ? PROTOCOL_UDP : PROTOCOL_ALL;
 	out_rule->in_out = CHECK_OP(direction, "in") ? DIRECTION_INCOMING : CHECK_OP(direction, "out") ? DIRECTION_OUTGOING : DIRECTION_NONE;
@@ -128,6 +186,8 @@ bool deserialize_rule(const char* rule_string, firewall_rule *out_rule) {
 	out_rule->dest_ip = ip_str_to_hl(dst_ip);
 	out_rule->dest_netmask = ip_str_to_hl(dst_mask);
 	out_rule->dest_port = dst_port;
+	out_rule->ttl = ttl;
+	strcpy(out_rule->dev, dev);
 
 	return true;
 }
@@ -6,11 +6,25 @@
  *   @note: This is based on http://www.roman10.net/2011/07/23/how-to-filter-network-packets-using-netfilterpart-2-implement-the-hook-function/
  */
 #include "common.h"
+#include "classifier.h"
+#include "ruleset_image.h"
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 #include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/jiffies.h>
+#include <linux/hash.h>
+#include <linux/workqueue.h>
+#include <linux/netdevice.h>
 
 #include <asm/uaccess.h>
 #include <linux/udp.h>
@@ -24,6 +38,44 @@ MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("linux-simple-firewall");
 MODULE_AUTHOR("Liu Feipeng/roman10, modified by Mateusz Midor");
 
+// precompiled ruleset to start with, made by "client compile"
+static char *ruleset = NULL;
+module_param(ruleset, charp, 0444);
+MODULE_PARM_DESC(ruleset, "Path of ruleset image to load at init, eg. /lib/firmware/firewall.img");
+
+#define RULESET_IMAGE_MAX_SIZE (256 << 20)
+#define BATCH_MAX_SIZE (64 << 20)
+
+// idle tcp flows are forgotten after this many seconds, 0 turns the fast path off
+static unsigned int flow_timeout = 120;
+module_param(flow_timeout, uint, 0644);
+MODULE_PARM_DESC(flow_timeout, "Seconds an accepted idle tcp flow skips classification, 0 disables the fast path");
+
+#define PROCFS_FLOWS_FILENAME "firewall_flows"
+
+// rules added with a ttl are kept apart from the policy list, up to this many
+static unsigned int dynamic_max = 65536;
+module_param(dynamic_max, uint, 0644);
+MODULE_PARM_DESC(dynamic_max, "Maximum number of rules with ttl at a time");
+
+#define PROCFS_DYNAMIC_FILENAME "firewall_dynamic"
+
+// sources sending more incoming packets per second get blocked for hh_block_ttl seconds
+static unsigned int hh_threshold = 0;
+module_param(hh_threshold, uint, 0644);
+MODULE_PARM_DESC(hh_threshold, "Incoming packets per second from one source that get it blocked, 0 disables detection");
+
+static unsigned int hh_block_ttl = 60;
+module_param(hh_block_ttl, uint, 0644);
+MODULE_PARM_DESC(hh_block_ttl, "Seconds a detected heavy hitter stays blocked");
+
+// logging classified packets costs far more than classifying them, so it is off unless debugging the rules
+static bool log_packets = false;
+module_param(log_packets, bool, 0644);
+MODULE_PARM_DESC(log_packets, "Log packets checked against the rules and their verdicts, rate limited");
+
+#define PROCFS_HH_FILENAME "firewall_hh"
+
 // single firewall rule as received from the user
 //struct user_friendly_firewall_rule {
 //	packet_direction in_out;
@@ -46,13 +98,122 @@ struct kernel_firewall_rule {
 // define the policy list head
 static struct kernel_firewall_rule policy_list;
 static unsigned int rule_count = 0;
+static unsigned int policy_version = 0;	// bumped on every change of the list, batches diffed against another one are stale
+
+// policy list compiled for the packet path; replaced as a whole on every policy change
+struct compiled_ruleset {
+	struct rcu_head rcu;
+	unsigned int rule_count;
+	unsigned int generation;	// flows accepted under older rulesets are classified again
+	firewall_dispatch dispatch;	// holds the packed rules too, the packet path needs nothing else
+};
+static struct compiled_ruleset __rcu *active_ruleset = NULL;
+static unsigned int ruleset_generation = 0;
+
+/*
+ * Stateful fast path: tcp flows accepted by the rules are remembered, so their following packets
+ * skip classification. The table is sharded per cpu; each shard is a set-associative cache
+ * where a full set evicts its least recently seen flow. A flow is dropped from the table on FIN/RST,
+ * when idle for flow_timeout, or when the ruleset it was accepted under gets replaced.
+ */
+#define FLOW_SETS	1024	// per shard, power of 2
+#define FLOW_WAYS	4
+
+struct flow_entry {
+	unsigned int src_ip;
+	unsigned int dest_ip;
+	unsigned short src_port;
+	unsigned short dest_port;
+	unsigned char in_out;
+	bool used;
+	int ifindex;
+	unsigned int generation;
+	unsigned long last_seen;	// jiffies
+};
+
+struct flow_shard {
+	spinlock_t lock;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long inserts;
+	unsigned long closed;		// by FIN/RST
+	unsigned long expired;		// idle for flow_timeout
+	unsigned long replaced;		// evicted from full set
+	struct flow_entry sets[FLOW_SETS][FLOW_WAYS];
+};
+
+static struct flow_shard **flow_shards = NULL; // indexed by cpu
+static u32 flow_hash_seed;
+
+/*
+ * Expiring rules, eg. blocklist entries of an intrusion detection system. Adding one is a hash insert
+ * instead of a ruleset compilation. They are checked before the policy and the fast path, and of
+ * several matching ones the earliest added wins; adding the same rule again only extends its life.
+ * A rule is hashed by its exact source address, else by its exact destination address, rules with
+ * neither go to a list walked for every packet. Expiry is a timer wheel of one second slots turned
+ * once a second by a delayed work; a rule past its time is ignored even before the wheel reaps it.
+ */
+#define DYNAMIC_HASH_BITS	12
+#define DYNAMIC_WHEEL_SLOTS	256	// seconds, power of 2; longer ttls take more turns of the wheel
+
+struct dynamic_rule {
+	firewall_rule rule;
+	unsigned long sequence;		// order of adding
+	unsigned long expires;		// jiffies
+	struct hlist_node node;		// in its lookup chain, rcu protected
+	struct hlist_node wheel;	// in its wheel slot, under dynamic_lock
+	struct rcu_head rcu;
+};
+
+static struct hlist_head dynamic_by_src[1 << DYNAMIC_HASH_BITS];
+static struct hlist_head dynamic_by_dest[1 << DYNAMIC_HASH_BITS];
+static HLIST_HEAD(dynamic_wild);
+static struct hlist_head dynamic_wheel[DYNAMIC_WHEEL_SLOTS];
+static unsigned long dynamic_wheel_second;	// next slot to reap, in jiffies / HZ
+static unsigned long dynamic_sequence = 0;
+static unsigned long dynamic_expired = 0;
+static unsigned int dynamic_count = 0;
+static DEFINE_SPINLOCK(dynamic_lock);	// serializes dynamic rule changes, readers use rcu
+
+static void reap_dynamic_rules(struct work_struct *work);
+static DECLARE_DELAYED_WORK(dynamic_reaper, reap_dynamic_rules);
+
+/*
+ * Heavy hitter detection: incoming packets are counted per source address in a count-min sketch,
+ * one per cpu so counting needs no lock (the IN hook runs in softirq). Counters are halved every
+ * second, lazily on the first packet of the second, so a steady rate r settles at about 2r.
+ * Only when the local estimate passes its share of the threshold are the other cpus' sketches
+ * summed up; a source over the threshold gets an expiring block rule.
+ */
+#define HH_ROWS		4
+#define HH_WIDTH	1024	// power of 2
+#define HH_REPORT_SIZE	64	// recent detections kept for /proc/firewall_hh
+
+struct hh_sketch {
+	unsigned long second;	// jiffies / HZ the counters were last halved to
+	unsigned int counts[HH_ROWS][HH_WIDTH];
+};
+
+struct hh_detection {
+	unsigned int src_ip;
+	unsigned int rate;		// estimated packets per second
+	unsigned long when;		// jiffies
+};
+
+static struct hh_sketch **hh_sketches = NULL; // indexed by cpu
+static u32 hh_seeds[HH_ROWS];
+static struct hh_detection hh_report[HH_REPORT_SIZE];
+static unsigned long hh_detections = 0;
+static unsigned long hh_failures = 0;	// block rule couldn't be added
+static DEFINE_SPINLOCK(hh_lock);		// protects the report
+
+// serializes policy list changes and ruleset compilation
+static DEFINE_MUTEX(policy_mutex);
 
 //the structure used to register the filtering function for incoming and outgoing packets
 static struct nf_hook_ops nfho_in;
 static struct nf_hook_ops nfho_out;
 
-static bool reading_done = false;
-
 
 int static sprintf_rule(char *buff, unsigned int index, firewall_rule *rule) {
 
@@ -71,8 +232,9 @@ int static sprintf_rule(char *buff, unsigned int index, firewall_rule *rule) {
 	sprintf(dst_ip, "%u.%u.%u.%u", ip_array[3], ip_array[2], ip_array[1], ip_array[0]);
 
 	// build final rule string
-	return sprintf(buff, "%u. dir %s, protocol %s, src ip %s, src port %u, dst ip %s, dst port %d, action %s\n",
-			index, dir, protocol, src_ip, rule->src_port, dst_ip, rule->dest_port, action);
+	return sprintf(buff, "%u. dir %s, protocol %s, src ip %s, src port %u, dst ip %s, dst port %d, action %s%s%s\n",
+			index, dir, protocol, src_ip, rule->src_port, dst_ip, rule->dest_port, action,
+			rule->dev[0] ? ", dev " : "", rule->dev);
 }
 
 /**
@@ -92,260 +254,425 @@ unsigned int port_str_to_int(char *port_str) {
 }
 
 /**
- * @brief 	Compare the two IP addresses, only the masked part
- */
-bool check_ip(unsigned int ip, unsigned int ip_rule, unsigned int mask) {
-	unsigned int tmp = ntohl(ip);    //network to host long
-	int cmp_len = 32;
-	int i = 0, j = 0;
-	printk(KERN_INFO "compare ip: %u <=> %u\n", tmp, ip_rule);
-	if (mask != 0) {
-		//printk(KERN_INFO "deal with mask\n");
-		//printk(KERN_INFO "mask: %d.%d.%d.%d\n", mask[0], mask[1], mask[2], mask[3]);
-		cmp_len = 0;
-		for (i = 0; i < 32; ++i) {
-			if (mask & (1 << (32 - 1 - i)))
-				cmp_len++;
-			else
-				break;
-		}
-	}
-	/*compare the two IP addresses for the first cmp_len bits*/
-	for (i = 31, j = 0; j < cmp_len; --i, ++j) {
-		if ((tmp & (1 << i)) != (ip_rule & (1 << i))) {
-			printk(KERN_INFO "ip compare: %d bit doesn't match\n", (32 - i));
-			return false;
-		}
-	}
-	return true;
-}
-
-/**
- * @brief	This function filters outgoing packets
+ * @brief	Extract the fields the rules are matched against from the packet
  */
-unsigned int hook_func_out(void *priv, struct sk_buff *skb, const struct nf_hook_state *state) {
-	/*get src address, src netmask, src port, dest ip, dest netmask, dest port, protocol*/
+static void get_packet_info(struct sk_buff *skb, packet_direction in_out, const struct net_device *dev,
+							firewall_packet *pkt, bool *tcp_closing) {
 	struct iphdr *ip_header = (struct iphdr *) skb_network_header(skb);
+	unsigned char *transport_header = (unsigned char *) ip_header + ip_header->ihl * 4;
 	struct udphdr *udp_header;
 	struct tcphdr *tcp_header;
-	struct list_head *p;
-	struct kernel_firewall_rule *entry;
-	firewall_rule *a_rule;
-	int i = 0;
 
-	/**get src and dest ip addresses**/
-	unsigned int src_ip = (unsigned int) ip_header->saddr;
-	unsigned int dest_ip = (unsigned int) ip_header->daddr;
-	unsigned int src_port = 0;
-	unsigned int dest_port = 0;
+	pkt->in_out = in_out;
+	pkt->ifindex = dev ? dev->ifindex : 0;
+	pkt->dev = dev ? dev->name : "";
+	pkt->proto = ip_header->protocol;
+	pkt->src_ip = ntohl(ip_header->saddr);
+	pkt->dest_ip = ntohl(ip_header->daddr);
+	pkt->src_port = 0;
+	pkt->dest_port = 0;
+	*tcp_closing = false;
 
 	/***get src and dest port number***/
 	if (ip_header->protocol == PROTOCOL_UDP) {
-		udp_header = (struct udphdr *) skb_transport_header(skb);
-		src_port = (unsigned int) ntohs(udp_header->source);
-		dest_port = (unsigned int) ntohs(udp_header->dest);
+		udp_header = (struct udphdr *) transport_header;
+		pkt->src_port = (unsigned int) ntohs(udp_header->source);
+		pkt->dest_port = (unsigned int) ntohs(udp_header->dest);
 	} else if (ip_header->protocol == PROTOCOL_TCP) {
-		tcp_header = (struct tcphdr *) skb_transport_header(skb);
-		src_port = (unsigned int) ntohs(tcp_header->source);
-		dest_port = (unsigned int) ntohs(tcp_header->dest);
+		tcp_header = (struct tcphdr *) transport_header;
+		pkt->src_port = (unsigned int) ntohs(tcp_header->source);
+		pkt->dest_port = (unsigned int) ntohs(tcp_header->dest);
+		*tcp_closing = tcp_header->fin || tcp_header->rst;
 	}
+}
 
-	printk(
-			KERN_INFO "OUT packet info: src ip: %u, src port: %u; dest ip: %u, dest port: %u; proto: %u\n",
-			src_ip, src_port, dest_ip, dest_port, ip_header->protocol);
+static bool flow_matches(const struct flow_entry *e, const firewall_packet *pkt) {
+	return e->src_ip == pkt->src_ip && e->dest_ip == pkt->dest_ip && e->src_port == pkt->src_port &&
+			e->dest_port == pkt->dest_port && e->in_out == pkt->in_out && e->ifindex == pkt->ifindex;
+}
 
-	//go through the firewall list and check if there is a match
-	//in case there are multiple matches, take the first one
-	list_for_each(p, &policy_list.list)
-	{
-		i++;
-		entry = list_entry(p, struct kernel_firewall_rule, list);
-		a_rule = &entry->rule;
-		printk(
-				KERN_INFO "rule %d: a_rule->in_out = %u; a_rule->src_ip = %u; a_rule->src_netmask=%u; a_rule->src_port=%u; a_rule->dest_ip=%u; a_rule->dest_netmask=%u; a_rule->dest_port=%u; a_rule->proto=%u; a_rule->action=%u\n",
-				i, a_rule->in_out, a_rule->src_ip, a_rule->src_netmask,
-				a_rule->src_port, a_rule->dest_ip, a_rule->dest_netmask,
-				a_rule->dest_port, a_rule->proto, a_rule->action);
-
-		//if a rule doesn't specify as "out", skip it
-		if (a_rule->in_out != DIRECTION_OUTGOING) {
-			printk(
-					KERN_INFO "rule %d (a_rule->in_out: %u) not match: out packet, rule doesn't specify as out\n",
-					i, a_rule->in_out);
+static bool flow_is_live(const struct flow_entry *e, unsigned int generation) {
+	return e->used && e->generation == generation && time_before(jiffies, e->last_seen + flow_timeout * HZ);
+}
+
+static struct flow_entry *flow_set(struct flow_shard *shard, const firewall_packet *pkt) {
+	u32 hash = jhash_3words(pkt->src_ip, pkt->dest_ip, (pkt->src_port << 16 | pkt->dest_port) ^ pkt->in_out, flow_hash_seed);
+	return shard->sets[hash & (FLOW_SETS - 1)];
+}
+
+/**
+ * @brief	Check if the packet belongs to a tcp flow accepted under given ruleset generation.
+ * 			A FIN or RST packet is still let through, but closes the flow
+ */
+static bool flow_lookup(const firewall_packet *pkt, bool tcp_closing, unsigned int generation) {
+	struct flow_shard *shard = flow_shards[raw_smp_processor_id()];
+	struct flow_entry *set;
+	bool hit = false;
+	int i;
+
+	if (!flow_timeout)
+		return false;
+
+	spin_lock_bh(&shard->lock);
+	set = flow_set(shard, pkt);
+	for (i = 0; i < FLOW_WAYS; i++) {
+		if (!set[i].used || !flow_matches(&set[i], pkt))
 			continue;
-		} else {
-			//check the protocol
-			if ((a_rule->proto == PROTOCOL_TCP) && (ip_header->protocol != PROTOCOL_TCP)) {
-				printk(
-						KERN_INFO "rule %d not match: rule-TCP, packet->not TCP\n",
-						i);
-				continue;
-			} else if ((a_rule->proto == PROTOCOL_UDP) && (ip_header->protocol != PROTOCOL_UDP)) {
-				printk(
-						KERN_INFO "rule %d not match: rule-UDP, packet->not UDP\n",
-						i);
-				continue;
-			}
 
-			//check the ip address
-			if (a_rule->src_ip == 0) {
-				//rule doesn't specify ip: match
-			} else {
-				if (!check_ip(src_ip, a_rule->src_ip, a_rule->src_netmask)) {
-					printk(KERN_INFO "rule %d not match: src ip mismatch\n", i);
-					continue;
-				}
-			}
-			if (a_rule->dest_ip == 0) {
-				//rule doesn't specify ip: match
-			} else {
-				if (!check_ip(dest_ip, a_rule->dest_ip, a_rule->dest_netmask)) {
-					printk(KERN_INFO "rule %d not match: dest ip mismatch\n",
-							i);
-					continue;
-				}
-			}
-			//check the port number
-			if (a_rule->src_port == 0) {
-				//rule doesn't specify src port: match
-			} else if (src_port != a_rule->src_port) {
-				printk(KERN_INFO "rule %d not match: src port dismatch\n", i);
-				continue;
-			}
-			if (a_rule->dest_port == 0) {
-				//rule doens't specify dest port: match
-			} else if (dest_port != a_rule->dest_port) {
-				printk(KERN_INFO "rule %d not match: dest port mismatch\n", i);
-				continue;
+		if (flow_is_live(&set[i], generation)) {
+			hit = true;
+			set[i].last_seen = jiffies;
+			if (tcp_closing) {
+				set[i].used = false;
+				shard->closed++;
 			}
+		} else {
+			if (set[i].generation == generation)
+				shard->expired++;
+			set[i].used = false;
+		}
+		break;
+	}
 
-			//a match is found: take action
-			if (a_rule->action == ACTION_BLOCK) {
-				printk(KERN_INFO "a match is found: %d, drop the packet\n", i);
-				printk(KERN_INFO "---------------------------------------\n");
-				return NF_DROP;
-			} else {
-				printk(KERN_INFO "a match is found: %d, accept the packet\n",
-						i);
-				printk(KERN_INFO "---------------------------------------\n");
-				return NF_ACCEPT;
-			}
+	if (hit)
+		shard->hits++;
+	else
+		shard->misses++;
+	spin_unlock_bh(&shard->lock);
+	return hit;
+}
+
+/**
+ * @brief	Remember the tcp flow of an accepted packet
+ */
+static void flow_insert(const firewall_packet *pkt, unsigned int generation) {
+	struct flow_shard *shard = flow_shards[raw_smp_processor_id()];
+	struct flow_entry *set, *victim = NULL;
+	int i;
+
+	if (!flow_timeout)
+		return;
+
+	spin_lock_bh(&shard->lock);
+	set = flow_set(shard, pkt);
+	for (i = 0; i < FLOW_WAYS; i++) {
+		if (!flow_is_live(&set[i], generation)) {
+			victim = &set[i];
+			break;
 		}
+		if (!victim || time_before(set[i].last_seen, victim->last_seen))
+			victim = &set[i];
+	}
+
+	if (flow_is_live(victim, generation))
+		shard->replaced++;
+
+	victim->src_ip = pkt->src_ip;
+	victim->dest_ip = pkt->dest_ip;
+	victim->src_port = pkt->src_port;
+	victim->dest_port = pkt->dest_port;
+	victim->in_out = pkt->in_out;
+	victim->ifindex = pkt->ifindex;
+	victim->generation = generation;
+	victim->last_seen = jiffies;
+	victim->used = true;
+	shard->inserts++;
+	spin_unlock_bh(&shard->lock);
+}
+
+/**
+ * @brief	Lookup chain of an expiring rule
+ */
+static struct hlist_head *dynamic_chain(const firewall_rule *rule) {
+	if (rule_prefix(rule->src_ip, rule->src_netmask) == 32)
+		return &dynamic_by_src[hash_32(rule->src_ip, DYNAMIC_HASH_BITS)];
+	if (rule_prefix(rule->dest_ip, rule->dest_netmask) == 32)
+		return &dynamic_by_dest[hash_32(rule->dest_ip, DYNAMIC_HASH_BITS)];
+	return &dynamic_wild;
+}
+
+/**
+ * @brief	Return the earliest added live rule of the chain matching the packet, if earlier than best
+ */
+static struct dynamic_rule *dynamic_scan(struct hlist_head *chain, const firewall_packet *pkt, struct dynamic_rule *best) {
+	struct dynamic_rule *d;
+
+	hlist_for_each_entry_rcu(d, chain, node)
+		if ((!best || d->sequence < best->sequence) && time_before(jiffies, READ_ONCE(d->expires)) &&
+			rule_matches(&d->rule, pkt))
+			best = d;
+	return best;
+}
+
+/**
+ * @brief	Find expiring rule for the packet. Called under rcu_read_lock
+ * @return	True if a rule matched, its action is stored in action
+ */
+static bool dynamic_lookup(const firewall_packet *pkt, action_type *action) {
+	struct dynamic_rule *best;
+
+	if (!READ_ONCE(dynamic_count))
+		return false;
+
+	best = dynamic_scan(&dynamic_by_src[hash_32(pkt->src_ip, DYNAMIC_HASH_BITS)], pkt, NULL);
+	best = dynamic_scan(&dynamic_by_dest[hash_32(pkt->dest_ip, DYNAMIC_HASH_BITS)], pkt, best);
+	best = dynamic_scan(&dynamic_wild, pkt, best);
+	if (best)
+		*action = best->rule.action;
+	return best != NULL;
+}
+
+static int add_dynamic_rule(const firewall_rule *rule, gfp_t gfp);
+
+/**
+ * @brief	Halve the counters once for every second passed since they last were
+ */
+static void hh_decay(struct hh_sketch *sketch, unsigned long second) {
+	unsigned long shift = second - sketch->second;
+	unsigned int *count = &sketch->counts[0][0];
+	int i;
+
+	if (!shift)
+		return;
+
+	for (i = 0; i < HH_ROWS * HH_WIDTH; i++)
+		count[i] = shift < 32 ? count[i] >> shift : 0;
+	WRITE_ONCE(sketch->second, second);
+}
+
+/**
+ * @brief	Block the source for hh_block_ttl seconds and report it
+ */
+static void hh_block(unsigned int src_ip, unsigned int rate) {
+	firewall_rule rule = {
+		.in_out = DIRECTION_INCOMING,
+		.src_ip = src_ip,
+		.src_netmask = 0xffffffff,
+		.proto = PROTOCOL_ALL,
+		.action = ACTION_BLOCK,
+		.ttl = max(READ_ONCE(hh_block_ttl), 1u),
+	};
+	bool added = add_dynamic_rule(&rule, GFP_ATOMIC) == 0;
+
+	spin_lock(&hh_lock);
+	if (added) {
+		hh_report[hh_detections % HH_REPORT_SIZE].src_ip = src_ip;
+		hh_report[hh_detections % HH_REPORT_SIZE].rate = rate;
+		hh_report[hh_detections % HH_REPORT_SIZE].when = jiffies;
+		hh_detections++;
+	} else {
+		hh_failures++;
+	}
+	spin_unlock(&hh_lock);
+}
+
+/**
+ * @brief	Count incoming packet of the source, block the source if it sends over hh_threshold packets a second.
+ * 			Called in softirq
+ * @return	True if the source got blocked
+ */
+static bool hh_count(unsigned int src_ip) {
+	struct hh_sketch *sketch = hh_sketches[smp_processor_id()];
+	unsigned long second = jiffies / HZ, age, limit = 2ul * READ_ONCE(hh_threshold);
+	unsigned int bucket[HH_ROWS], local = ~0u, estimate, total = 0;
+	int row, cpu;
+
+	hh_decay(sketch, second);
+	for (row = 0; row < HH_ROWS; row++) {
+		bucket[row] = jhash_1word(src_ip, hh_seeds[row]) & (HH_WIDTH - 1);
+		local = min(local, ++sketch->counts[row][bucket[row]]);
+	}
+
+	// traffic of a source is usually spread over cpus, this cpu checks its share first
+	if ((unsigned long) local * num_online_cpus() < limit)
+		return false;
+
+	for_each_online_cpu(cpu) {
+		sketch = hh_sketches[cpu];
+		age = second - READ_ONCE(sketch->second); // not decayed yet on the other cpu
+		if (age >= 32)
+			continue;
+		estimate = ~0u;
+		for (row = 0; row < HH_ROWS; row++)
+			estimate = min(estimate, READ_ONCE(sketch->counts[row][bucket[row]]) >> age);
+		total += estimate;
+	}
+
+	if (total < limit)
+		return false;
+
+	hh_block(src_ip, total / 2);
+	return true;
+}
+
+/**
+ * @brief	Look the packet up in the compiled ruleset.
+ * 			In case there are multiple matches, take the first one
+ */
+static unsigned int filter_packet(const firewall_packet *pkt, bool tcp_closing) {
+	struct compiled_ruleset *rs;
+	unsigned int verdict = NF_ACCEPT;
+	int match = NO_RULE_MATCHED;
+	action_type action;
+
+	rcu_read_lock();
+
+	// expiring rules apply to established flows too
+	if (dynamic_lookup(pkt, &action)) {
+		rcu_read_unlock();
+		return action == ACTION_BLOCK ? NF_DROP : NF_ACCEPT;
+	}
+
+	if (pkt->in_out == DIRECTION_INCOMING && READ_ONCE(hh_threshold) && hh_count(pkt->src_ip)) {
+		rcu_read_unlock();
+		return NF_DROP;
+	}
+
+	rs = rcu_dereference(active_ruleset);
+
+	// established tcp flows were already accepted by the current rules
+	if (rs && pkt->proto == PROTOCOL_TCP && flow_lookup(pkt, tcp_closing, rs->generation)) {
+		rcu_read_unlock();
+		return NF_ACCEPT;
 	}
-	printk(KERN_INFO "no matching is found, accept the packet\n");
-	printk(KERN_INFO "---------------------------------------\n");
-	return NF_ACCEPT;
+
+	if (rs)
+		match = classify_dispatch(&rs->dispatch, pkt);
+	if (match != NO_RULE_MATCHED && rs->dispatch.keys[match].action == ACTION_BLOCK)
+		verdict = NF_DROP;
+	else if (rs && pkt->proto == PROTOCOL_TCP && !tcp_closing)
+		flow_insert(pkt, rs->generation);
+	rcu_read_unlock();
+
+	if (unlikely(READ_ONCE(log_packets)) && net_ratelimit())
+		printk(KERN_INFO "%s packet src ip: %u, src port: %u; dest ip: %u, dest port: %u; proto: %u; rule %d (0 - none), %s\n",
+				pkt->in_out == DIRECTION_INCOMING ? "IN" : "OUT",
+				pkt->src_ip, pkt->src_port, pkt->dest_ip, pkt->dest_port, pkt->proto,
+				match == NO_RULE_MATCHED ? 0 : match + 1,
+				verdict == NF_DROP ? "drop" : "accept");
+	return verdict;
 }
 
+/**
+ * @brief	This function filters outgoing packets
+ */
+unsigned int hook_func_out(void *priv, struct sk_buff *skb, const struct nf_hook_state *state) {
+	firewall_packet pkt;
+	bool tcp_closing;
+
+	get_packet_info(skb, DIRECTION_OUTGOING, state->out, &pkt, &tcp_closing);
+	return filter_packet(&pkt, tcp_closing);
+}
 
 /**
  * @brief	This function filters incoming packets
  */
 unsigned int hook_func_in(void *priv, struct sk_buff *skb, const struct nf_hook_state *state) {
-	/*get src address, src netmask, src port, dest ip, dest netmask, dest port, protocol*/
-	struct iphdr *ip_header = (struct iphdr *) skb_network_header(skb);
-	struct udphdr *udp_header;
-	struct tcphdr *tcp_header;
-	struct list_head *p;
+	firewall_packet pkt;
+	bool tcp_closing;
+
+	get_packet_info(skb, DIRECTION_INCOMING, state->in, &pkt, &tcp_closing);
+	return filter_packet(&pkt, tcp_closing);
+}
+
+static void free_compiled_ruleset(struct compiled_ruleset *rs) {
+	firewall_dispatch_free(&rs->dispatch);
+	kfree(rs);
+}
+
+static void free_compiled_ruleset_rcu(struct rcu_head *head) {
+	free_compiled_ruleset(container_of(head, struct compiled_ruleset, rcu));
+}
+
+/**
+ * @brief	Switch the packet path to new ruleset, free the old one once no packet uses it.
+ * 			Called with policy_mutex held
+ */
+static void publish_ruleset(struct compiled_ruleset *rs) {
+	struct compiled_ruleset *old = rcu_dereference_protected(active_ruleset, lockdep_is_held(&policy_mutex));
+
+	rs->generation = ++ruleset_generation; // invalidates all remembered flows
+	rcu_assign_pointer(active_ruleset, rs);
+	if (old)
+		call_rcu(&old->rcu, free_compiled_ruleset_rcu);
+}
+
+/**
+ * @brief	Ifindex of the interface of given name, 0 if there is none
+ */
+static int ifindex_of(const char *name) {
+	struct net_device *dev = dev_get_by_name(&init_net, name);
+	int ifindex = 0;
+
+	if (dev) {
+		ifindex = dev->ifindex;
+		dev_put(dev);
+	}
+	return ifindex;
+}
+
+/**
+ * @brief	Compile list of count rules and publish it; the packet path keeps the previous ruleset
+ * 			if compiling fails. Called with policy_mutex held
+ * @return	0 on success
+ */
+static int compile_rules(struct list_head *list, unsigned int count) {
 	struct kernel_firewall_rule *entry;
-	firewall_rule *a_rule;
-	int i = 0;
-	/**get src and dest ip addresses**/
-	unsigned int src_ip = (unsigned int) ip_header->saddr;
-	unsigned int dest_ip = (unsigned int) ip_header->daddr;
-	unsigned int src_port = 0;
-	unsigned int dest_port = 0;
-	/***get src and dest port number***/
-	if (ip_header->protocol == PROTOCOL_UDP) {
-		udp_header = (struct udphdr *) (skb_transport_header(skb) + 20);
-		src_port = (unsigned int) ntohs(udp_header->source);
-		dest_port = (unsigned int) ntohs(udp_header->dest);
-	} else if (ip_header->protocol == PROTOCOL_TCP) {
-		tcp_header = (struct tcphdr *) (skb_transport_header(skb) + 20);
-		src_port = (unsigned int) ntohs(tcp_header->source);
-		dest_port = (unsigned int) ntohs(tcp_header->dest);
-	}
-	printk(
-			KERN_INFO "IN packet info: src ip: %u, src port: %u; dest ip: %u, dest port: %u; proto: %u\n",
-			src_ip, src_port, dest_ip, dest_port, ip_header->protocol);
-	//go through the firewall list and check if there is a match
-	//in case there are multiple matches, take the first one
-	list_for_each(p, &policy_list.list)
-	{
-		i++;
-		entry = list_entry(p, struct kernel_firewall_rule, list);
-		a_rule = &entry->rule;
-		printk(
-				KERN_INFO "rule %d: a_rule->in_out = %u; a_rule->src_ip = %u; a_rule->src_netmask=%u; a_rule->src_port=%u; a_rule->dest_ip=%u; a_rule->dest_netmask=%u; a_rule->dest_port=%u; a_rule->proto=%u; a_rule->action=%u\n",
-				i, a_rule->in_out, a_rule->src_ip, a_rule->src_netmask,
-				a_rule->src_port, a_rule->dest_ip, a_rule->dest_netmask,
-				a_rule->dest_port, a_rule->proto, a_rule->action);
-		//if a rule doesn't specify as "in", skip it
-		if (a_rule->in_out != DIRECTION_INCOMING) {
-			printk(
-					KERN_INFO "rule %d (a_rule->in_out:%u) not match: in packet, rule doesn't specify as in\n",
-					i, a_rule->in_out);
-			continue;
-		} else {
-			//check the protocol
-			if ((a_rule->proto == PROTOCOL_TCP) && (ip_header->protocol != PROTOCOL_TCP)) {
-				printk(
-						KERN_INFO "rule %d not match: rule-TCP, packet->not TCP\n",
-						i);
-				continue;
-			} else if ((a_rule->proto == PROTOCOL_UDP) && (ip_header->protocol != PROTOCOL_UDP)) {
-				printk(
-						KERN_INFO "rule %d not match: rule-UDP, packet->not UDP\n",
-						i);
-				continue;
-			}
-			//check the ip address
-			if (a_rule->src_ip == 0) {
-				//
-			} else {
-				if (!check_ip(src_ip, a_rule->src_ip, a_rule->src_netmask)) {
-					printk(KERN_INFO "rule %d not match: src ip mismatch\n", i);
-					continue;
-				}
-			}
-			if (a_rule->dest_ip == 0) {
-				//
-			} else {
-				if (!check_ip(dest_ip, a_rule->dest_ip, a_rule->dest_netmask)) {
-					printk(KERN_INFO "rule %d not match: dest ip mismatch\n",
-							i);
-					continue;
-				}
-			}
-			//check the port number
-			if (a_rule->src_port == 0) {
-				//rule doesn't specify src port: match
-			} else if (src_port != a_rule->src_port) {
-				printk(KERN_INFO "rule %d not match: src port mismatch\n", i);
-				continue;
-			}
-			if (a_rule->dest_port == 0) {
-				//rule doens't specify dest port: match
-			} else if (dest_port != a_rule->dest_port) {
-				printk(KERN_INFO "rule %d not match: dest port mismatch\n", i);
-				continue;
-			}
-			//a match is found: take action
-			if (a_rule->action == ACTION_BLOCK) {
-				printk(KERN_INFO "a match is found: %d, drop the packet\n", i);
-				printk(KERN_INFO "---------------------------------------\n");
-				return NF_DROP;
-			} else {
-				printk(KERN_INFO "a match is found: %d, accept the packet\n",
-						i);
-				printk(KERN_INFO "---------------------------------------\n");
-				return NF_ACCEPT;
-			}
-		}
+	struct compiled_ruleset *rs;
+	firewall_rule *rules;
+	unsigned int i = 0;
+	bool built;
+
+	rs = kzalloc(sizeof(*rs), GFP_KERNEL);
+	rules = vmalloc(sizeof(firewall_rule) * max(count, 1u));
+	if (!rs || !rules) {
+		vfree(rules);
+		kfree(rs);
+		return -ENOMEM;
+	}
+
+	list_for_each_entry(entry, list, list)
+		rules[i++] = entry->rule;
+	rs->rule_count = i;
+
+	built = firewall_dispatch_build(&rs->dispatch, rules, rs->rule_count);
+	vfree(rules);
+	if (!built) {
+		kfree(rs);
+		return -ENOMEM;
 	}
-	printk(KERN_INFO "no matching is found, accept the packet\n");
-	printk(KERN_INFO "---------------------------------------\n");
-	return NF_ACCEPT;
+
+	firewall_dispatch_resolve(&rs->dispatch, ifindex_of);
+
+	publish_ruleset(rs);
+	return 0;
+}
+
+/**
+ * @brief	Compile the policy list and publish it. Called with policy_mutex held
+ * @return	0 on success
+ */
+static int compile_policy(void) {
+	return compile_rules(&policy_list.list, rule_count);
+}
+
+/**
+ * @brief	Append rule to the policy list. Called with policy_mutex held
+ * @return	0 on success
+ */
+static int append_rule(const firewall_rule *user_rule) {
+	struct kernel_firewall_rule* new_rule;
+
+	new_rule = kmalloc(sizeof(*new_rule), GFP_KERNEL);
+	if (new_rule == NULL)
+		return -ENOMEM;
+
+	memcpy(&new_rule->rule, user_rule, sizeof(firewall_rule));
+	INIT_LIST_HEAD(&(new_rule->list));
+	list_add_tail(&(new_rule->list), &(policy_list.list));
+	rule_count++;
+	policy_version++;
+	return 0;
 }
 
 /**
@@ -354,21 +681,19 @@ unsigned int hook_func_in(void *priv, struct sk_buff *skb, const struct nf_hook_
 void add_rule(firewall_rule* user_rule) {
 	char buff[256];
 
-	struct kernel_firewall_rule* new_rule;
-	new_rule = kmalloc(sizeof(*new_rule), GFP_KERNEL);
-	if (new_rule == NULL) {
+	mutex_lock(&policy_mutex);
+	if (append_rule(user_rule)) {
 		printk(KERN_INFO "error: cannot allocate memory for new_rule\n");
-		return;
+		goto out;
 	}
 
-	memcpy(&new_rule->rule, user_rule, sizeof(firewall_rule));
-
-	rule_count++;
-	sprintf_rule(buff, rule_count, &new_rule->rule);
+	sprintf_rule(buff, rule_count, user_rule);
 	printk(KERN_INFO "add_a_rule %s", buff );
 
-	INIT_LIST_HEAD(&(new_rule->list));
-	list_add_tail(&(new_rule->list), &(policy_list.list));
+	if (compile_policy())
+		printk(KERN_ERR "error: cannot compile ruleset, packets still filtered by previous rules\n");
+out:
+	mutex_unlock(&policy_mutex);
 }
 
 /**
@@ -379,6 +704,7 @@ void delete_rule(int num) {
 	struct list_head *p, *q;
 	struct kernel_firewall_rule *a_rule;
 	printk(KERN_INFO "delete a rule: %d\n", num);
+	mutex_lock(&policy_mutex);
 	list_for_each_safe(p, q, &policy_list.list) {
 		++i;
 		if (i == num) {
@@ -386,11 +712,207 @@ void delete_rule(int num) {
 			list_del(p);
 			kfree(a_rule);
 			rule_count--;
-			return;
+			policy_version++;
+			if (compile_policy())
+				printk(KERN_ERR "error: cannot compile ruleset, packets still filtered by previous rules\n");
+			break;
 		}
 	}
+	mutex_unlock(&policy_mutex);
 }
 
+/**
+ * @brief	Wheel slot a rule expiring at given jiffies goes to; the slot is reaped no earlier than that
+ */
+static struct hlist_head *dynamic_wheel_slot(unsigned long expires) {
+	return &dynamic_wheel[DIV_ROUND_UP(expires, HZ) & (DYNAMIC_WHEEL_SLOTS - 1)];
+}
+
+static bool same_rule(const firewall_rule *a, const firewall_rule *b) {
+	return a->in_out == b->in_out && a->src_ip == b->src_ip && a->src_netmask == b->src_netmask &&
+			a->src_port == b->src_port && a->dest_ip == b->dest_ip && a->dest_netmask == b->dest_netmask &&
+			a->dest_port == b->dest_port && a->proto == b->proto && a->action == b->action &&
+			strcmp(a->dev, b->dev) == 0;
+}
+
+/**
+ * @brief	Add rule that expires after rule->ttl seconds, or extend the life of the same rule
+ * @return	0 on success
+ */
+static int add_dynamic_rule(const firewall_rule *rule, gfp_t gfp) {
+	struct dynamic_rule *d, *new_rule;
+	struct hlist_head *chain = dynamic_chain(rule);
+	unsigned long expires = jiffies + (unsigned long) min(rule->ttl, 0x7fffffffu / HZ) * HZ;
+	int ret = 0;
+
+	new_rule = kmalloc(sizeof(*new_rule), gfp);
+	if (!new_rule)
+		return -ENOMEM;
+
+	spin_lock_bh(&dynamic_lock);
+	hlist_for_each_entry(d, chain, node)
+		if (same_rule(&d->rule, rule)) {
+			WRITE_ONCE(d->expires, expires);
+			d->rule.ttl = rule->ttl;
+			hlist_del(&d->wheel);
+			hlist_add_head(&d->wheel, dynamic_wheel_slot(expires));
+			goto out;
+		}
+
+	if (dynamic_count >= dynamic_max) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	new_rule->rule = *rule;
+	new_rule->sequence = dynamic_sequence++;
+	new_rule->expires = expires;
+	hlist_add_head(&new_rule->wheel, dynamic_wheel_slot(expires));
+	hlist_add_head_rcu(&new_rule->node, chain);
+	WRITE_ONCE(dynamic_count, dynamic_count + 1);
+	new_rule = NULL;
+out:
+	spin_unlock_bh(&dynamic_lock);
+	kfree(new_rule);
+	return ret;
+}
+
+/**
+ * @brief	Turn the timer wheel: drop expired rules of the slots passed since the last turn
+ */
+static void reap_dynamic_rules(struct work_struct *work) {
+	unsigned long now = jiffies, second = now / HZ, behind;
+	struct dynamic_rule *d;
+	struct hlist_node *tmp;
+
+	spin_lock_bh(&dynamic_lock);
+	behind = min(second - dynamic_wheel_second + 1, (unsigned long) DYNAMIC_WHEEL_SLOTS);
+	for (; behind; behind--, dynamic_wheel_second++)
+		hlist_for_each_entry_safe(d, tmp, &dynamic_wheel[dynamic_wheel_second & (DYNAMIC_WHEEL_SLOTS - 1)], wheel) {
+			if (time_before(now, d->expires))
+				continue; // due on a later turn
+			hlist_del(&d->wheel);
+			hlist_del_rcu(&d->node);
+			kfree_rcu(d, rcu);
+			WRITE_ONCE(dynamic_count, dynamic_count - 1);
+			dynamic_expired++;
+		}
+	dynamic_wheel_second = second + 1;
+	spin_unlock_bh(&dynamic_lock);
+
+	schedule_delayed_work(&dynamic_reaper, HZ);
+}
+
+/**
+ * @brief	Free all expiring rules. Called with the hooks unregistered and the reaper stopped
+ */
+static void free_dynamic_rules(void) {
+	struct dynamic_rule *d;
+	struct hlist_node *tmp;
+	int i;
+
+	for (i = 0; i < DYNAMIC_WHEEL_SLOTS; i++)
+		hlist_for_each_entry_safe(d, tmp, &dynamic_wheel[i], wheel) {
+			hlist_del(&d->wheel);
+			hlist_del_rcu(&d->node);
+			kfree_rcu(d, rcu);
+		}
+	dynamic_count = 0;
+}
+
+/**
+ * @brief	Load ruleset image compiled by the client; its index is used as is
+ * @return	0 on success
+ */
+static int load_ruleset_image(const char *path) {
+	struct compiled_ruleset *rs;
+	firewall_rule *rules;
+	const char *error;
+	void *image = NULL;
+	loff_t size;
+	unsigned int i;
+	int ret;
+
+	// the image is installed next to firmware (/lib/firmware), so it is read as such by IMA/LSM hooks
+	ret = kernel_read_file_from_path((char *) path, &image, &size, RULESET_IMAGE_MAX_SIZE, READING_FIRMWARE);
+	if (ret) {
+		printk(KERN_ERR "cannot read ruleset image %s: %d\n", path, ret);
+		return ret;
+	}
+
+	rs = kzalloc(sizeof(*rs), GFP_KERNEL);
+	if (!rs) {
+		vfree(image);
+		return -ENOMEM;
+	}
+
+	error = ruleset_image_read(image, size, &rules, &rs->rule_count, &rs->dispatch);
+	vfree(image);
+	if (error) {
+		printk(KERN_ERR "invalid ruleset image %s: %s\n", path, error);
+		kfree(rs);
+		return -EINVAL;
+	}
+	firewall_dispatch_resolve(&rs->dispatch, ifindex_of);
+
+	// the policy list is what /proc/firewall shows and edits
+	mutex_lock(&policy_mutex);
+	for (i = 0; i < rs->rule_count; i++)
+		if ((ret = append_rule(&rules[i])))
+			break;
+	vfree(rules);
+
+	if (ret)
+		free_compiled_ruleset(rs);
+	else
+		publish_ruleset(rs);
+	mutex_unlock(&policy_mutex);
+
+	if (!ret)
+		printk(KERN_INFO "loaded %u rules from ruleset image %s\n", rs->rule_count, path);
+	return ret;
+}
+
+/**
+ * @brief	Check if the interface event changes which interface any per-interface index applies to
+ */
+static bool dispatch_stale(const firewall_dispatch *fd, unsigned long event, const struct net_device *dev) {
+	bool named, resolved;
+	unsigned int i;
+
+	for (i = 0; i < fd->dev_count; i++) {
+		named = strncmp(fd->devs[i].dev, dev->name, DEV_NAME_LENGTH) == 0;
+		resolved = fd->devs[i].ifindex == dev->ifindex;
+		if (event == NETDEV_UNREGISTER ? resolved : named != resolved)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * @brief	Recompile the policy when an interface the rules name comes, goes or gets renamed,
+ * 			so the per-interface indexes follow the ifindexes
+ */
+static int firewall_netdev_event(struct notifier_block *nb, unsigned long event, void *ptr) {
+	struct net_device *dev = netdev_notifier_info_to_dev(ptr);
+	struct compiled_ruleset *rs;
+
+	if (!net_eq(dev_net(dev), &init_net) ||
+		(event != NETDEV_REGISTER && event != NETDEV_UNREGISTER && event != NETDEV_CHANGENAME))
+		return NOTIFY_DONE;
+
+	mutex_lock(&policy_mutex);
+	rs = rcu_dereference_protected(active_ruleset, lockdep_is_held(&policy_mutex));
+	if (rs && dispatch_stale(&rs->dispatch, event, dev) && compile_policy())
+		printk(KERN_ERR "error: cannot compile ruleset, rules of interface %s may not apply\n", dev->name);
+	mutex_unlock(&policy_mutex);
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block firewall_netdev_notifier = {
+	.notifier_call = firewall_netdev_event,
+};
+
 /**
  * @brief	Add an example rule
  */
@@ -416,38 +938,241 @@ void add_nossh_rule(void) {
 		printk(KERN_INFO "add_nossh_rule - deserialize_rule failed");
 }
 
-// communication from user space
-static int firewall_open(struct inode *node, struct file *f) {
-	reading_done = false; // can read
+// communication from user space; rules are listed under policy_mutex, one per seq_file record
+static void *firewall_seq_start(struct seq_file *m, loff_t *pos) {
+	mutex_lock(&policy_mutex);
+	return seq_list_start(&policy_list.list, *pos);
+}
+
+static void *firewall_seq_next(struct seq_file *m, void *v, loff_t *pos) {
+	return seq_list_next(v, &policy_list.list, pos);
+}
+
+static void firewall_seq_stop(struct seq_file *m, void *v) {
+	mutex_unlock(&policy_mutex);
+}
+
+/**
+ * @brief	Read firewall rules at /proc/firewall
+ */
+static int firewall_seq_show(struct seq_file *m, void *v) {
+	struct kernel_firewall_rule *entry = list_entry(v, struct kernel_firewall_rule, list);
+	char kernel_buff[256];
+
+	sprintf_rule(kernel_buff, m->index + 1, &entry->rule);
+	seq_puts(m, kernel_buff);
 	return 0;
 }
 
-static int firewall_release(struct inode *node, struct file *f) {
+static const struct seq_operations firewall_seq_ops = {
+	.start = firewall_seq_start,
+	.next  = firewall_seq_next,
+	.stop  = firewall_seq_stop,
+	.show  = firewall_seq_show,
+};
+
+static int firewall_open(struct inode *node, struct file *f) {
+	return seq_open(f, &firewall_seq_ops);
+}
+
+// where the last read() of /proc/firewall_rules stopped, so the next one goes on from there instead of walking the
+// list from its head again; only valid while the policy version stays the same
+struct rules_cursor {
+	bool valid;
+	unsigned int version;
+	loff_t pos;
+	struct list_head *entry;	// at pos, NULL past the last rule
+};
+
+// the list head stands for the version line in front of the rules
+static void *rules_seq_start(struct seq_file *m, loff_t *pos) {
+	struct rules_cursor *cursor = m->private;
+
+	mutex_lock(&policy_mutex);
+	if (cursor->valid && cursor->version == policy_version && cursor->pos == *pos)
+		return cursor->entry;
+	return seq_list_start_head(&policy_list.list, *pos);
+}
+
+static void *rules_seq_next(struct seq_file *m, void *v, loff_t *pos) {
+	struct rules_cursor *cursor = m->private;
+
+	cursor->entry = seq_list_next(v, &policy_list.list, pos);
+	cursor->pos = *pos;
+	cursor->version = policy_version;
+	cursor->valid = true;
+	return cursor->entry;
+}
+
+/**
+ * @brief	Read firewall rules at /proc/firewall_rules, in the syntax "add" takes, after the policy version
+ */
+static int rules_seq_show(struct seq_file *m, void *v) {
+	struct kernel_firewall_rule *entry = list_entry(v, struct kernel_firewall_rule, list);
+	char rule_string[MAX_RULE_STRING_LENGTH];
+
+	if (v == &policy_list.list) {
+		seq_printf(m, RULES_VERSION_FORMAT, policy_version);
+		return 0;
+	}
+	serialize_rule(&entry->rule, rule_string);
+	seq_printf(m, "%s\n", rule_string);
 	return 0;
 }
 
+static const struct seq_operations rules_seq_ops = {
+	.start = rules_seq_start,
+	.next  = rules_seq_next,
+	.stop  = firewall_seq_stop,
+	.show  = rules_seq_show,
+};
+
+static int rules_open(struct inode *node, struct file *f) {
+	return seq_open_private(f, &rules_seq_ops, sizeof(struct rules_cursor));
+}
+
+// rule inserted by a batch, goes after the given rule of the list as it was before the batch (0 - at the front)
+struct batch_insert {
+	unsigned int after;
+	struct kernel_firewall_rule *new_rule;
+};
+
 /**
- * @brief	Read firewall rules at /proc/firewall
+ * @brief	Apply batch of "del <rule number>" and "ins <after rule number> <rule>" lines.
+ * 			Rule numbers refer to the policy list of given version, "ins" lines come in
+ * 			non-decreasing order of the rule number. Either all operations are applied and the new
+ * 			list is compiled and enforced, or none is applied and the old list and ruleset stay
+ * @return	0 on success, -EAGAIN if the list changed since that version
  */
-static ssize_t firewall_read(struct file *f, char __user *user_buff, size_t size, loff_t *offset) {
+static int apply_batch(unsigned int version, char *batch) {
+	struct kernel_firewall_rule **old_rules = NULL;
 	struct kernel_firewall_rule *entry;
-	char kernel_buff[256];
-	int rule_index = 1;
-	int written_count = 0;
-	int total_written_count = 0;
+	struct batch_insert *inserts = NULL;
+	unsigned int max_inserts = 1, insert_count = 0, old_count, new_count, number, consumed, i, k;
+	bool *deleted = NULL;
+	firewall_rule rule;
+	LIST_HEAD(new_list);
+	char *line;
+	int ret = 0;
 
-	if (reading_done)
-		return 0; // 0 bytes left for reading
+	for (line = batch; *line; line++)
+		max_inserts += (*line == '\n');
 
-	list_for_each_entry(entry, &policy_list.list, list) {
-		written_count = sprintf_rule(kernel_buff, rule_index, &entry->rule);
-		copy_to_user(user_buff + total_written_count, kernel_buff, written_count);
-		total_written_count += written_count;
-		rule_index++;
+	mutex_lock(&policy_mutex);
+	if (version != policy_version) {
+		ret = -EAGAIN;
+		goto out;
+	}
+	old_count = rule_count;
+	old_rules = vmalloc(sizeof(*old_rules) * (old_count + 1));
+	deleted = vzalloc(sizeof(*deleted) * (old_count + 1));
+	inserts = vmalloc(sizeof(*inserts) * max_inserts);
+	if (!old_rules || !deleted || !inserts) {
+		ret = -ENOMEM;
+		goto out;
 	}
 
-	reading_done = true;
-	return total_written_count; // return number of bytes we put in the file for reading
+	i = 1;
+	list_for_each_entry(entry, &policy_list.list, list)
+		old_rules[i++] = entry;
+	new_count = old_count;
+
+	// validate everything before touching the list
+	while ((line = strsep(&batch, "\n"))) {
+		if (sscanf(line, "del %u", &number) == 1) {
+			if (number < 1 || number > old_count || deleted[number]) {
+				ret = -EINVAL;
+				goto out;
+			}
+			deleted[number] = true;
+			new_count--;
+		} else if (sscanf(line, "ins %u %n", &number, &consumed) == 1) {
+			if (number > old_count || (insert_count && number < inserts[insert_count - 1].after) ||
+				!deserialize_rule(line + consumed, &rule) || rule.ttl) {
+				ret = -EINVAL;
+				goto out;
+			}
+			inserts[insert_count].new_rule = kmalloc(sizeof(struct kernel_firewall_rule), GFP_KERNEL);
+			if (!inserts[insert_count].new_rule) {
+				ret = -ENOMEM;
+				goto out;
+			}
+			inserts[insert_count].new_rule->rule = rule;
+			inserts[insert_count++].after = number;
+			new_count++;
+		} else if (*line != '\0') {
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+	// merge kept and inserted rules into the new list; deleted rules are freed only once it is enforced
+	for (i = 0, k = 0; i <= old_count; i++) {
+		if (i > 0) {
+			list_del(&old_rules[i]->list);
+			if (!deleted[i])
+				list_add_tail(&old_rules[i]->list, &new_list);
+		}
+		for (; k < insert_count && inserts[k].after == i; k++)
+			list_add_tail(&inserts[k].new_rule->list, &new_list);
+	}
+
+	ret = compile_rules(&new_list, new_count);
+	if (ret) {
+		// put the old list back as it was, the new rules get freed below
+		INIT_LIST_HEAD(&policy_list.list);
+		for (i = 1; i <= old_count; i++)
+			list_add_tail(&old_rules[i]->list, &policy_list.list);
+		goto out;
+	}
+
+	list_splice(&new_list, &policy_list.list);
+	for (i = 1; i <= old_count; i++)
+		if (deleted[i])
+			kfree(old_rules[i]);
+	rule_count = new_count;
+	policy_version++;
+	printk(KERN_INFO "Batch applied: %u rules inserted, %u rules total\n", insert_count, rule_count);
+	insert_count = 0; // new rules are owned by the list now
+
+out:
+	if (ret)
+		printk(KERN_INFO "Batch rejected: %d\n", ret);
+	for (k = 0; k < insert_count; k++)
+		kfree(inserts[k].new_rule);
+	mutex_unlock(&policy_mutex);
+	vfree(inserts);
+	vfree(deleted);
+	vfree(old_rules);
+	return ret;
+}
+
+/**
+ * @brief	Take whole "batch <version>\n<operations>" write at once and apply it atomically
+ */
+static ssize_t firewall_write_batch(const char __user *user_buff, size_t size) {
+	unsigned int version;
+	char *batch;
+	int ret;
+
+	if (size > BATCH_MAX_SIZE)
+		return -E2BIG;
+
+	batch = vmalloc(size + 1);
+	if (!batch)
+		return -ENOMEM;
+
+	if (copy_from_user(batch, user_buff, size)) {
+		vfree(batch);
+		return -EFAULT;
+	}
+	batch[size] = '\0';
+
+	if (sscanf(batch, BATCH_HEADER_FORMAT, &version) != 1)
+		ret = -EINVAL;
+	else
+		ret = apply_batch(version, batch + strcspn(batch, "\n")); // skip the "batch" line
+	vfree(batch);
+	return ret ? ret : size;
 }
 
 /**
@@ -456,6 +1181,7 @@ static ssize_t firewall_read(struct file *f, char __user *user_buff, size_t size
 static ssize_t firewall_write(struct file *f, const char __user *user_buff, size_t size, loff_t *offset) {
 	#define CHECK_OP(op1, op2) ((strcmp(op1, op2) == 0))
 
+	size_t original_size = size;
 	char kernel_buff[256] = {'\0'};
 	char operation[15] = {'\0'};
 	firewall_rule rule;
@@ -466,13 +1192,19 @@ static ssize_t firewall_write(struct file *f, const char __user *user_buff, size
 		size = sizeof(kernel_buff) -1; // -1 for null terminator
 
 	copy_from_user(kernel_buff, user_buff, size);
-	sscanf(kernel_buff, "%s", operation);
+	sscanf(kernel_buff, "%14s", operation);
 
-	if (CHECK_OP(operation, "add")) {
-		if (deserialize_rule(kernel_buff + 4, &rule)) // +4 to skip "add "
+	if (CHECK_OP(operation, "batch"))
+		return firewall_write_batch(user_buff, original_size);
+	else if (CHECK_OP(operation, "add")) {
+		if (!deserialize_rule(kernel_buff + 4, &rule)) // +4 to skip "add "
+			printk(KERN_INFO "Add rule failed: invalid rule string\n");
+		else if (!rule.ttl)
 			add_rule(&rule);
+		else if (add_dynamic_rule(&rule, GFP_KERNEL))
+			printk(KERN_INFO "Add rule failed: cannot add rule with ttl\n");
 		else
-			printk(KERN_INFO "Add rule failed: invalid rule string\n");
+			printk(KERN_INFO "Added rule with ttl %us\n", rule.ttl);
 	}
 	else if (CHECK_OP(operation, "del")) {
 		sscanf(kernel_buff + 4, "%u", &rule_index);	// +4 to skip "add "
@@ -489,27 +1221,309 @@ static ssize_t firewall_write(struct file *f, const char __user *user_buff, size
 static struct file_operations firewall_proc_ops = {
 	.owner   = THIS_MODULE,
 	.open    = firewall_open,
-	.read    = firewall_read,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
 	.write	 = firewall_write,
-	.release = firewall_release,
+	.release = seq_release,
+};
+
+static struct file_operations rules_proc_ops = {
+	.owner   = THIS_MODULE,
+	.open    = rules_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = seq_release_private,
+};
+
+/**
+ * @brief	Show fast path table occupancy and hit rate at /proc/firewall_flows
+ */
+static int flows_show(struct seq_file *m, void *v) {
+	struct compiled_ruleset *rs;
+	struct flow_shard *shard;
+	unsigned long total_hits = 0, total_misses = 0, lookups;
+	unsigned int generation = 0, entries, total_entries = 0, i, j;
+	int cpu;
+
+	rcu_read_lock();
+	rs = rcu_dereference(active_ruleset);
+	if (rs)
+		generation = rs->generation;
+	rcu_read_unlock();
+
+	seq_printf(m, "flow timeout: %us, table size per cpu: %u\n", flow_timeout, FLOW_SETS * FLOW_WAYS);
+	seq_printf(m, "%4s %8s %12s %12s %10s %10s %10s %10s\n",
+			"cpu", "entries", "hits", "misses", "inserts", "closed", "expired", "replaced");
+	for_each_possible_cpu(cpu) {
+		shard = flow_shards[cpu];
+		entries = 0;
+		spin_lock_bh(&shard->lock);
+		for (i = 0; i < FLOW_SETS; i++)
+			for (j = 0; j < FLOW_WAYS; j++)
+				entries += flow_is_live(&shard->sets[i][j], generation);
+		seq_printf(m, "%4d %8u %12lu %12lu %10lu %10lu %10lu %10lu\n", cpu, entries, shard->hits, shard->misses,
+				shard->inserts, shard->closed, shard->expired, shard->replaced);
+		total_entries += entries;
+		total_hits += shard->hits;
+		total_misses += shard->misses;
+		spin_unlock_bh(&shard->lock);
+	}
+
+	lookups = total_hits + total_misses;
+	seq_printf(m, "total entries: %u, hit rate: %lu.%lu%%\n", total_entries,
+			lookups ? total_hits * 100 / lookups : 0, lookups ? total_hits * 1000 / lookups % 10 : 0);
+	return 0;
+}
+
+static int flows_open(struct inode *node, struct file *f) {
+	return single_open(f, flows_show, NULL);
+}
+
+static struct file_operations flows_proc_ops = {
+	.owner   = THIS_MODULE,
+	.open    = flows_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+static void dynamic_show_chain(struct seq_file *m, struct hlist_head *chain, unsigned long now) {
+	char rule_string[MAX_RULE_STRING_LENGTH];
+	struct dynamic_rule *d;
+	unsigned long expires;
+
+	hlist_for_each_entry_rcu(d, chain, node) {
+		expires = READ_ONCE(d->expires);
+		if (!time_before(now, expires))
+			continue;
+		serialize_rule(&d->rule, rule_string);
+		seq_printf(m, "%s, expires in %lus\n", rule_string, DIV_ROUND_UP(expires - now, HZ));
+	}
+}
+
+/**
+ * @brief	List live rules with ttl at /proc/firewall_dynamic
+ */
+static int dynamic_show(struct seq_file *m, void *v) {
+	unsigned long now = jiffies;
+	int i;
+
+	seq_printf(m, "rules with ttl: %u of %u, expired: %lu\n", READ_ONCE(dynamic_count), dynamic_max, dynamic_expired);
+	rcu_read_lock();
+	for (i = 0; i < (1 << DYNAMIC_HASH_BITS); i++) {
+		dynamic_show_chain(m, &dynamic_by_src[i], now);
+		dynamic_show_chain(m, &dynamic_by_dest[i], now);
+	}
+	dynamic_show_chain(m, &dynamic_wild, now);
+	rcu_read_unlock();
+	return 0;
+}
+
+static int dynamic_open(struct inode *node, struct file *f) {
+	return single_open(f, dynamic_show, NULL);
+}
+
+static struct file_operations dynamic_proc_ops = {
+	.owner   = THIS_MODULE,
+	.open    = dynamic_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+/**
+ * @brief	Show heavy hitter detection settings and recent detections at /proc/firewall_hh
+ */
+static int hh_show(struct seq_file *m, void *v) {
+	unsigned long now = jiffies, i, count;
+	struct hh_detection *d;
+	char ip[16];
+
+	seq_printf(m, "threshold: %u packets/s%s, block for: %us\n", hh_threshold, hh_threshold ? "" : " (disabled)", hh_block_ttl);
+
+	spin_lock_bh(&hh_lock);
+	seq_printf(m, "sketch per cpu: %u x %u, detections: %lu, not blocked for lack of room: %lu\n",
+			HH_ROWS, HH_WIDTH, hh_detections, hh_failures);
+	seq_printf(m, "%-16s %12s %12s\n", "source", "packets/s", "seconds ago");
+
+	// most recent first
+	count = min(hh_detections, (unsigned long) HH_REPORT_SIZE);
+	for (i = 1; i <= count; i++) {
+		d = &hh_report[(hh_detections - i) % HH_REPORT_SIZE];
+		ip_hl_to_str(d->src_ip, ip);
+		seq_printf(m, "%-16s %12u %12lu\n", ip, d->rate, (now - d->when) / HZ);
+	}
+	spin_unlock_bh(&hh_lock);
+	return 0;
+}
+
+static int hh_open(struct inode *node, struct file *f) {
+	return single_open(f, hh_show, NULL);
+}
+
+static struct file_operations hh_proc_ops = {
+	.owner   = THIS_MODULE,
+	.open    = hh_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
 };
 
 static void firewall_create_procentry(void) {
 	if (proc_create_data(PROCFS_FILENAME, 0666, NULL, &firewall_proc_ops, NULL))
 		printk(KERN_INFO "created /proc/%s\n", PROCFS_FILENAME);
+	if (proc_create_data(PROCFS_RULES_FILENAME, 0444, NULL, &rules_proc_ops, NULL))
+		printk(KERN_INFO "created /proc/%s\n", PROCFS_RULES_FILENAME);
+	if (proc_create_data(PROCFS_FLOWS_FILENAME, 0444, NULL, &flows_proc_ops, NULL))
+		printk(KERN_INFO "created /proc/%s\n", PROCFS_FLOWS_FILENAME);
+	if (proc_create_data(PROCFS_DYNAMIC_FILENAME, 0444, NULL, &dynamic_proc_ops, NULL))
+		printk(KERN_INFO "created /proc/%s\n", PROCFS_DYNAMIC_FILENAME);
+	if (proc_create_data(PROCFS_HH_FILENAME, 0444, NULL, &hh_proc_ops, NULL))
+		printk(KERN_INFO "created /proc/%s\n", PROCFS_HH_FILENAME);
 }
 
 static void firewall_remove_procentry(void) {
+	remove_proc_entry(PROCFS_HH_FILENAME, NULL);
+	remove_proc_entry(PROCFS_DYNAMIC_FILENAME, NULL);
+	remove_proc_entry(PROCFS_FLOWS_FILENAME, NULL);
+	remove_proc_entry(PROCFS_RULES_FILENAME, NULL);
 	remove_proc_entry(PROCFS_FILENAME, NULL);
 	printk(KERN_INFO "removed /proc/%s\n", PROCFS_FILENAME);
 }
 
+/**
+ * @brief	Allocate fast path table shards, each on its cpu's memory node
+ * @return	0 on success
+ */
+static int alloc_flow_shards(void) {
+	int cpu;
+
+	flow_shards = kcalloc(nr_cpu_ids, sizeof(*flow_shards), GFP_KERNEL);
+	if (!flow_shards)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		flow_shards[cpu] = vzalloc_node(sizeof(struct flow_shard), cpu_to_node(cpu));
+		if (!flow_shards[cpu])
+			return -ENOMEM;
+		spin_lock_init(&flow_shards[cpu]->lock);
+	}
+
+	get_random_bytes(&flow_hash_seed, sizeof(flow_hash_seed));
+	return 0;
+}
+
+static void free_flow_shards(void) {
+	int cpu;
+
+	if (!flow_shards)
+		return;
+
+	for_each_possible_cpu(cpu)
+		vfree(flow_shards[cpu]);
+	kfree(flow_shards);
+	flow_shards = NULL;
+}
+
+/**
+ * @brief	Allocate heavy hitter sketches, each on its cpu's memory node
+ * @return	0 on success
+ */
+static int alloc_hh_sketches(void) {
+	unsigned long second = jiffies / HZ;
+	int cpu;
+
+	hh_sketches = kcalloc(nr_cpu_ids, sizeof(*hh_sketches), GFP_KERNEL);
+	if (!hh_sketches)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		hh_sketches[cpu] = vzalloc_node(sizeof(struct hh_sketch), cpu_to_node(cpu));
+		if (!hh_sketches[cpu])
+			return -ENOMEM;
+		hh_sketches[cpu]->second = second;
+	}
+
+	get_random_bytes(hh_seeds, sizeof(hh_seeds));
+	return 0;
+}
+
+static void free_hh_sketches(void) {
+	int cpu;
+
+	if (!hh_sketches)
+		return;
+
+	for_each_possible_cpu(cpu)
+		vfree(hh_sketches[cpu]);
+	kfree(hh_sketches);
+	hh_sketches = NULL;
+}
+
+/**
+ * @brief	Free the policy list and the compiled ruleset
+ */
+static void free_policy(void) {
+	struct list_head *p, *q;
+	struct kernel_firewall_rule *a_rule;
+	struct compiled_ruleset *rs;
+
+	printk(KERN_INFO "free policy list\n");
+	list_for_each_safe(p, q, &policy_list.list)
+	{
+		a_rule = list_entry(p, struct kernel_firewall_rule, list);
+		list_del(p);
+		kfree(a_rule);
+	}
+	rule_count = 0;
+
+	rs = rcu_dereference_protected(active_ruleset, 1);
+	RCU_INIT_POINTER(active_ruleset, NULL);
+	if (rs)
+		free_compiled_ruleset(rs);
+
+	rcu_barrier(); // wait for rulesets still queued for freeing
+}
+
 /* Initialization routine */
 static int __init  init_firewall_module(void) {
+	int ret;
+
 	printk(KERN_INFO "initialize kernel module\n");
+	INIT_LIST_HEAD(&(policy_list.list));
+
+	if ((ret = alloc_flow_shards()) || (ret = alloc_hh_sketches())) {
+		free_hh_sketches();
+		free_flow_shards();
+		return ret;
+	}
+
+	// whole policy is in place before the first packet is filtered
+	if (ruleset) {
+		if ((ret = load_ruleset_image(ruleset))) {
+			free_policy();
+			free_hh_sketches();
+			free_flow_shards();
+			return ret;
+		}
+	} else {
+		/*this part of code is for testing purpose*/
+		add_nossh_rule();
+		add_a_test_rule();
+	}
+
+	// without it rules bound to an interface would keep its ifindex after a rename or unregister
+	if ((ret = register_netdevice_notifier(&firewall_netdev_notifier))) {
+		printk(KERN_ERR "cannot register netdevice notifier: %d\n", ret);
+		free_policy();
+		free_hh_sketches();
+		free_flow_shards();
+		return ret;
+	}
 	firewall_create_procentry();
 
-	INIT_LIST_HEAD(&(policy_list.list));
+	dynamic_wheel_second = jiffies / HZ;
+	schedule_delayed_work(&dynamic_reaper, HZ);
 
 	/* Fill in the hook structure for incoming packet hook*/
 	nfho_in.hook = hook_func_in;
@@ -525,30 +1539,21 @@ static int __init  init_firewall_module(void) {
 	nfho_out.priority = NF_IP_PRI_FIRST;
 	nf_register_hook(&nfho_out);    // Register the hook
 
-//	/*this part of code is for testing purpose*/
-	add_nossh_rule();
-	add_a_test_rule();
 	return 0;
 }
 
 /* Cleanup routine */
 static void __exit cleanup_firewall_module(void) {
-	struct list_head *p, *q;
-	struct kernel_firewall_rule *a_rule;
-
 	nf_unregister_hook(&nfho_in);
 	nf_unregister_hook(&nfho_out);
-
-	printk(KERN_INFO "free policy list\n");
-	list_for_each_safe(p, q, &policy_list.list)
-	{
-		printk(KERN_INFO "free one\n");
-		a_rule = list_entry(p, struct kernel_firewall_rule, list);
-		list_del(p);
-		kfree(a_rule);
-	}
+	cancel_delayed_work_sync(&dynamic_reaper);
+	unregister_netdevice_notifier(&firewall_netdev_notifier);
 
 	firewall_remove_procentry();
+	free_dynamic_rules();
+	free_policy();
+	free_hh_sketches();
+	free_flow_shards();
 	printk(KERN_INFO "kernel module unloaded.\n");
 }
 
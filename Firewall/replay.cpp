@@ -0,0 +1,502 @@
+/*
+ * replay.cpp
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mateusz
+ *
+ *  Offline replay of a pcap capture through the firewall classification engines.
+ *  Every packet is classified by every engine, the engines are timed and compared against
+ *  the reference linear walk; any verdict mismatch is reported and makes the exit status 1.
+ */
+
+#include "classifier.h"
+#include "rules_file.h"
+#include "ruleset_image.h"
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+using namespace std;
+
+// pcap link types we can find an ipv4 header in
+enum {LINKTYPE_NULL = 0, LINKTYPE_ETHERNET = 1, LINKTYPE_RAW = 101, LINKTYPE_LOOP = 108,
+	LINKTYPE_LINUX_SLL = 113, LINKTYPE_IPV4 = 228, LINKTYPE_LINUX_SLL2 = 276};
+
+// how many mismatching packets to print per engine
+const unsigned int MAX_REPORTED_MISMATCHES = 10;
+
+/**
+ * @name	classification_engine
+ * @brief	Named classification function with its prebuilt state
+ */
+struct classification_engine {
+	const char *name;
+	int (*classify)(const void *state, const firewall_packet *pkt);
+	const void *state;
+};
+
+struct linear_state {
+	const firewall_rule *rules;
+	unsigned int count;
+};
+
+int classify_with_linear(const void *state, const firewall_packet *pkt) {
+	const linear_state *s = (const linear_state *) state;
+	return classify_linear(s->rules, s->count, pkt);
+}
+
+int classify_with_index(const void *state, const firewall_packet *pkt) {
+	return classify_dispatch((const firewall_dispatch *) state, pkt);
+}
+
+/**
+ * @name	interface_ifindex
+ * @brief	Stand-in for the kernel's ifindex: interfaces are numbered as replay first sees their names
+ */
+int interface_ifindex(const char *dev) {
+	static map<string, int> ifindexes;
+	return ifindexes.emplace(dev, ifindexes.size() + 1).first->second;
+}
+
+/**
+ * @name	get_u16 / get_u32
+ * @brief	Read integer from capture data, swap bytes if capture was written on other endian machine
+ */
+unsigned int get_u16_be(const unsigned char *p) {
+	return (p[0] << 8) | p[1];
+}
+
+unsigned int get_u32(const unsigned char *p, bool swapped) {
+	unsigned int v;
+	memcpy(&v, p, sizeof(v));
+	return swapped ? __builtin_bswap32(v) : v;
+}
+
+/**
+ * @name	find_ipv4_header
+ * @brief	Skip link layer header of the captured frame
+ * @return	Pointer to ipv4 header or NULL if frame doesn't carry ipv4
+ */
+const unsigned char *find_ipv4_header(unsigned int linktype, const unsigned char *frame, unsigned int &len) {
+	unsigned int skip, ethertype, family;
+
+	switch (linktype) {
+	case LINKTYPE_ETHERNET:
+		if (len < 14)
+			return NULL;
+		skip = 14;
+		ethertype = get_u16_be(frame + 12);
+		while ((ethertype == 0x8100 || ethertype == 0x88a8) && len >= skip + 4) { // vlan tags
+			ethertype = get_u16_be(frame + skip + 2);
+			skip += 4;
+		}
+		if (ethertype != 0x0800)
+			return NULL;
+		break;
+	case LINKTYPE_LINUX_SLL:
+		if (len < 16 || get_u16_be(frame + 14) != 0x0800)
+			return NULL;
+		skip = 16;
+		break;
+	case LINKTYPE_LINUX_SLL2:
+		if (len < 20 || get_u16_be(frame) != 0x0800)
+			return NULL;
+		skip = 20;
+		break;
+	case LINKTYPE_NULL:
+	case LINKTYPE_LOOP:
+		if (len < 4)
+			return NULL;
+		family = get_u32(frame, false);
+		if (family != 2 && family != 0x02000000) // AF_INET in either byte order
+			return NULL;
+		skip = 4;
+		break;
+	case LINKTYPE_RAW:
+	case LINKTYPE_IPV4:
+		skip = 0;
+		break;
+	default:
+		return NULL;
+	}
+
+	len -= skip;
+	if (len < 20 || (frame[skip] >> 4) != 4)
+		return NULL;
+	return frame + skip;
+}
+
+/**
+ * @name	parse_ipv4_packet
+ * @brief	Fill packet fields the way the firewall module sees them
+ * @return	True if ip header is valid
+ */
+bool parse_ipv4_packet(const unsigned char *ip, unsigned int len, firewall_packet *pkt) {
+	unsigned int header_len = (ip[0] & 0x0f) * 4;
+	unsigned int fragment_offset = get_u16_be(ip + 6) & 0x1fff;
+
+	if (header_len < 20 || header_len > len)
+		return false;
+
+	pkt->proto = ip[9];
+	pkt->src_ip = (ip[12] << 24) | (ip[13] << 16) | (ip[14] << 8) | ip[15];
+	pkt->dest_ip = (ip[16] << 24) | (ip[17] << 16) | (ip[18] << 8) | ip[19];
+	pkt->src_port = 0;
+	pkt->dest_port = 0;
+
+	if ((pkt->proto == PROTOCOL_TCP || pkt->proto == PROTOCOL_UDP) && fragment_offset == 0 && len >= header_len + 4) {
+		pkt->src_port = get_u16_be(ip + header_len);
+		pkt->dest_port = get_u16_be(ip + header_len + 2);
+	}
+	return true;
+}
+
+/**
+ * @name	load_pcap_file
+ * @brief	Read ipv4 packets from classic pcap file; every packet is classified in each of given directions
+ * @return	True on success
+ */
+bool load_pcap_file(const string &filename, const vector<packet_direction> &directions, const char *dev,
+					vector<firewall_packet> &packets, vector<unsigned int> &record_numbers, unsigned int &record_count) {
+	ifstream file(filename, ios::binary);
+	if (!file) {
+		cout << "Can't open pcap file: " << filename << endl;
+		return false;
+	}
+	vector<unsigned char> data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+
+	if (data.size() < 24) {
+		cout << "Not a pcap file: " << filename << endl;
+		return false;
+	}
+
+	bool swapped;
+	unsigned int magic = get_u32(&data[0], false);
+	if (magic == 0xa1b2c3d4 || magic == 0xa1b23c4d)
+		swapped = false;
+	else if (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1)
+		swapped = true;
+	else {
+		cout << "Not a pcap file (pcapng is not supported): " << filename << endl;
+		return false;
+	}
+
+	unsigned int linktype = get_u32(&data[20], swapped) & 0xffff;
+	size_t pos = 24;
+	record_count = 0;
+
+	while (pos + 16 <= data.size()) {
+		unsigned int captured_len = get_u32(&data[pos + 8], swapped);
+		pos += 16;
+		if (captured_len > data.size() - pos) {
+			cout << "Truncated pcap record " << record_count + 1 << ", stop reading" << endl;
+			break;
+		}
+
+		record_count++;
+		unsigned int len = captured_len;
+		const unsigned char *ip = find_ipv4_header(linktype, &data[pos], len);
+		firewall_packet pkt;
+		if (ip && parse_ipv4_packet(ip, len, &pkt))
+			for (packet_direction dir : directions) {
+				pkt.dev = dev;
+				pkt.ifindex = dev[0] ? interface_ifindex(dev) : 0;
+				pkt.in_out = dir;
+				packets.push_back(pkt);
+				record_numbers.push_back(record_count);
+			}
+		pos += captured_len;
+	}
+	return true;
+}
+
+/**
+ * @name	load_ruleset_image
+ * @brief	Read rules and the prebuilt indexes from image compiled by the client
+ * @return	True on success
+ */
+bool load_ruleset_image(const string &filename, vector<firewall_rule> &rules, firewall_dispatch *dispatch) {
+	ifstream file(filename, ios::binary);
+	vector<char> image((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+	firewall_rule *image_rules;
+	unsigned int rule_count;
+
+	const char *error = ruleset_image_read(image.data(), image.size(), &image_rules, &rule_count, dispatch);
+	if (error) {
+		cout << "Invalid ruleset image " << filename << ": " << error << endl;
+		return false;
+	}
+	rules.assign(image_rules, image_rules + rule_count);
+	fw_free(image_rules);
+	return true;
+}
+
+/**
+ * @name	is_ruleset_image
+ */
+bool is_ruleset_image(const string &filename) {
+	ifstream file(filename, ios::binary);
+	uint32_t magic = 0;
+	return file.read((char *) &magic, sizeof(magic)) && magic == RULESET_IMAGE_MAGIC;
+}
+
+/**
+ * @name	random_ip
+ * @brief	Address from a few /16 networks, so that rules and packets overlap
+ */
+unsigned int random_ip(mt19937 &rng) {
+	static const unsigned int NETWORKS[] = {0x0a000000, 0x0a010000, 0xc0a80000, 0xac100000};
+	return NETWORKS[rng() % 4] | (rng() & 0xffff);
+}
+
+/**
+ * @name	generate_rules
+ * @brief	Random policy shaped like a real one: mostly host/subnet and service port rules
+ */
+const char *RANDOM_INTERFACES[] = {"eth0", "eth1"};
+
+void generate_rules(unsigned int count, mt19937 &rng, vector<firewall_rule> &rules) {
+	static const unsigned int PREFIXES[] = {0xffffffff, 0xffffff00, 0xffff0000};
+	firewall_rule rule;
+
+	for (unsigned int i = 0; i < count; i++) {
+		rule.proto = (rng() % 10 < 1) ? PROTOCOL_ALL : (rng() % 2) ? PROTOCOL_TCP : PROTOCOL_UDP;
+		rule.in_out = (rng() % 2) ? DIRECTION_INCOMING : DIRECTION_OUTGOING;
+		rule.action = (rng() % 2) ? ACTION_BLOCK : ACTION_UNBLOCK;
+		rule.src_ip = (rng() % 2) ? random_ip(rng) : 0;
+		rule.src_netmask = PREFIXES[rng() % 3];
+		rule.src_port = (rng() % 10 < 1) ? 1024 + rng() % 64 : 0;
+		rule.dest_ip = (rng() % 2) ? random_ip(rng) : 0;
+		rule.dest_netmask = PREFIXES[rng() % 3];
+		rule.dest_port = (rng() % 10 < 8) ? 1 + rng() % 1024 : 0;
+		rule.ttl = 0;
+		strcpy(rule.dev, (rng() % 10 < 1) ? RANDOM_INTERFACES[rng() % 2] : "");
+		rules.push_back(rule);
+	}
+}
+
+/**
+ * @name	generate_packets
+ */
+void generate_packets(unsigned int count, const vector<packet_direction> &directions, mt19937 &rng,
+					  vector<firewall_packet> &packets, vector<unsigned int> &record_numbers) {
+	static const unsigned int PROTOCOLS[] = {PROTOCOL_TCP, PROTOCOL_UDP, 1};
+	firewall_packet pkt;
+
+	for (unsigned int i = 0; i < count; i++) {
+		pkt.in_out = directions[rng() % directions.size()];
+		pkt.proto = PROTOCOLS[rng() % 3];
+		pkt.src_ip = random_ip(rng);
+		pkt.dest_ip = random_ip(rng);
+		pkt.src_port = (pkt.proto == 1) ? 0 : 1024 + rng() % 64;
+		pkt.dest_port = (pkt.proto == 1) ? 0 : 1 + rng() % 1024;
+		pkt.dev = RANDOM_INTERFACES[rng() % 2];
+		pkt.ifindex = interface_ifindex(pkt.dev);
+		packets.push_back(pkt);
+		record_numbers.push_back(i + 1);
+	}
+}
+
+/**
+ * @name	run_engine
+ * @brief	Classify all packets with the engine using given number of threads, store matched rule indexes
+ * @return	Seconds it took
+ */
+double run_engine(const classification_engine &engine, const vector<firewall_packet> &packets,
+				  vector<int> &results, unsigned int thread_count, unsigned int rounds) {
+	vector<thread> threads;
+	size_t chunk = (packets.size() + thread_count - 1) / thread_count;
+
+	results.resize(packets.size());
+	auto start = chrono::steady_clock::now();
+	for (unsigned int t = 0; t < thread_count; t++)
+		threads.emplace_back([&, t]() {
+			size_t first = min(packets.size(), t * chunk);
+			size_t last = min(packets.size(), first + chunk);
+			for (unsigned int r = 0; r < rounds; r++)
+				for (size_t i = first; i < last; i++)
+					results[i] = engine.classify(engine.state, &packets[i]);
+		});
+	for (thread &t : threads)
+		t.join();
+
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+string ip_to_string(unsigned int ip) {
+	char buff[16];
+	sprintf(buff, "%u.%u.%u.%u", ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff);
+	return buff;
+}
+
+string packet_to_string(const firewall_packet &pkt) {
+	return string(pkt.in_out == DIRECTION_INCOMING ? "IN " : "OUT ") +
+		(pkt.proto == PROTOCOL_TCP ? "tcp " : pkt.proto == PROTOCOL_UDP ? "udp " : "proto " + to_string(pkt.proto) + " ") +
+		ip_to_string(pkt.src_ip) + ":" + to_string(pkt.src_port) + " -> " +
+		ip_to_string(pkt.dest_ip) + ":" + to_string(pkt.dest_port);
+}
+
+/**
+ * @name	verdict_to_string
+ * @brief	Describe engine result as "rule N (block)" with 1-based rule numbers, as /proc/firewall lists them
+ */
+string verdict_to_string(int match, const vector<firewall_rule> &rules) {
+	if (match == NO_RULE_MATCHED)
+		return "no rule (accept)";
+	return "rule " + to_string(match + 1) + (rules[match].action == ACTION_BLOCK ? " (block)" : " (accept)");
+}
+
+bool is_drop(int match, const vector<firewall_rule> &rules) {
+	return match != NO_RULE_MATCHED && rules[match].action == ACTION_BLOCK;
+}
+
+void print_usage() {
+	cout << "Usage: replay [-t threads] [-r rounds] [-d in|out|both] [-i interface] <rules file|ruleset image> <pcap file>\n";
+	cout << "       replay [-t threads] [-r rounds] [-d in|out|both] -s <rule count> [-n packet count]\n";
+	cout << "\t-i\tinterface the captured packets went through, default: none, only rules for any interface apply\n";
+	cout << "\t-s\tclassify random packets against random rules instead of files\n";
+	cout << "\t-n\tnumber of random packets, default: 100000\n";
+	cout << "\t-t\tnumber of classifying threads, default: number of cpus\n";
+	cout << "\t-r\tclassify the capture this many times for stable timing, default: 1\n";
+	cout << "\t-d\tdirection to classify the packets in, default: both\n";
+	cout << endl;
+}
+
+/**
+ * Program entry point
+ */
+int main(int argc, char *argv[]) {
+	unsigned int thread_count = max(1u, thread::hardware_concurrency());
+	unsigned int rounds = 1;
+	vector<packet_direction> directions = {DIRECTION_INCOMING, DIRECTION_OUTGOING};
+	unsigned int synthetic_rules = 0, synthetic_packets = 100000;
+	string direction, interface;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:r:d:s:n:i:")) != -1) {
+		switch (opt) {
+		case 'i':
+			interface = optarg;
+			break;
+		case 's':
+			synthetic_rules = max(1, atoi(optarg));
+			break;
+		case 'n':
+			synthetic_packets = max(1, atoi(optarg));
+			break;
+		case 't':
+			thread_count = max(1, atoi(optarg));
+			break;
+		case 'r':
+			rounds = max(1, atoi(optarg));
+			break;
+		case 'd':
+			direction = optarg;
+			if (direction == "in")
+				directions = {DIRECTION_INCOMING};
+			else if (direction == "out")
+				directions = {DIRECTION_OUTGOING};
+			else if (direction != "both") {
+				print_usage();
+				return 2;
+			}
+			break;
+		default:
+			print_usage();
+			return 2;
+		}
+	}
+	if (argc - optind != (synthetic_rules ? 0 : 2)) {
+		print_usage();
+		return 2;
+	}
+
+	// rules given as compiled image are checked with the index the image carries
+	vector<firewall_rule> rules;
+	vector<firewall_packet> packets;
+	vector<unsigned int> record_numbers;
+	unsigned int record_count;
+	firewall_dispatch dispatch;
+	mt19937 rng(1);
+	if (synthetic_rules) {
+		generate_rules(synthetic_rules, rng, rules);
+		generate_packets(synthetic_packets, directions, rng, packets, record_numbers);
+		record_count = synthetic_packets;
+		if (!firewall_dispatch_build(&dispatch, rules.data(), rules.size())) {
+			cout << "Out of memory building the index" << endl;
+			return 2;
+		}
+	} else if (is_ruleset_image(argv[optind])) {
+		if (!load_ruleset_image(argv[optind], rules, &dispatch))
+			return 2;
+	} else {
+		if (!load_rules_file(argv[optind], rules))
+			return 2;
+		if (!firewall_dispatch_build(&dispatch, rules.data(), rules.size())) {
+			cout << "Out of memory building the index" << endl;
+			return 2;
+		}
+	}
+
+	firewall_dispatch_resolve(&dispatch, interface_ifindex);
+
+	if (!synthetic_rules && !load_pcap_file(argv[optind + 1], directions, interface.c_str(), packets, record_numbers, record_count))
+		return 2;
+
+	cout << "rules: " << rules.size() << ", pcap records: " << record_count
+		 << ", packets to classify: " << packets.size() << ", threads: " << thread_count << endl;
+	if (packets.empty())
+		return 0;
+
+	// first engine is the reference
+	linear_state linear = {rules.data(), (unsigned int) rules.size()};
+	const vector<classification_engine> engines = {
+		{"linear", classify_with_linear, &linear},
+		{"indexed", classify_with_index, &dispatch},
+	};
+
+	vector<vector<int>> results(engines.size());
+	printf("%-10s %12s %10s %10s %10s\n", "engine", "Mpackets/s", "ns/packet", "dropped", "accepted");
+	for (size_t e = 0; e < engines.size(); e++) {
+		double seconds = run_engine(engines[e], packets, results[e], thread_count, rounds);
+		double classified = (double) packets.size() * rounds;
+		size_t dropped = 0;
+		for (int match : results[e])
+			dropped += is_drop(match, rules);
+
+		printf("%-10s %12.3f %10.1f %10zu %10zu\n", engines[e].name, classified / seconds / 1e6,
+			   seconds * 1e9 * thread_count / classified, dropped, packets.size() - dropped);
+	}
+
+	// compare verdicts against the reference engine
+	unsigned int total_mismatches = 0;
+	for (size_t e = 1; e < engines.size(); e++) {
+		unsigned int mismatches = 0, other_rule = 0;
+		for (size_t i = 0; i < packets.size(); i++) {
+			int expected = results[0][i], actual = results[e][i];
+			if (expected == actual)
+				continue;
+			if (is_drop(expected, rules) == is_drop(actual, rules)) {
+				other_rule++; // same verdict from another rule
+				continue;
+			}
+			if (++mismatches <= MAX_REPORTED_MISMATCHES)
+				cout << engines[e].name << " mismatch, pcap record " << record_numbers[i] << " " << packet_to_string(packets[i])
+					 << ": " << engines[0].name << " " << verdict_to_string(expected, rules)
+					 << ", " << engines[e].name << " " << verdict_to_string(actual, rules) << endl;
+		}
+		cout << engines[e].name << ": " << mismatches << " verdict mismatches, "
+			 << other_rule << " same verdicts by another rule" << endl;
+		total_mismatches += mismatches;
+	}
+
+	firewall_dispatch_free(&dispatch);
+	return total_mismatches ? 1 : 0;
+}
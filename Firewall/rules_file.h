@@ -0,0 +1,61 @@
+/*
+ * rules_file.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mateusz
+ *
+ *  Rules file for the firewall userspace tools: one rule per line in client syntax, eg.
+ *  "add tcp out block anyip anyip 0 anyip anyip 22". The "add" keyword is optional,
+ *  empty lines and lines starting with # are skipped.
+ */
+
+#ifndef RULES_FILE_H_
+#define RULES_FILE_H_
+
+#include "common.h"
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/**
+ * @name	load_rules_file
+ * @brief	Read rules from file, in file order
+ * @return	True on success, False if file can't be opened or has a misformatted rule
+ */
+inline bool load_rules_file(const std::string &filename, std::vector<firewall_rule> &rules) {
+	std::ifstream file(filename);
+	std::string line;
+	unsigned int line_number = 0;
+	firewall_rule rule;
+
+	if (!file) {
+		std::cout << "Can't open rules file: " << filename << std::endl;
+		return false;
+	}
+
+	while (getline(file, line)) {
+		line_number++;
+
+		size_t first = line.find_first_not_of(" \t\r");
+		if (first == std::string::npos || line[first] == '#')
+			continue;
+
+		if (line.compare(first, 4, "add ") == 0)
+			first += 4;
+
+		if (!deserialize_rule(line.c_str() + first, &rule)) {
+			std::cout << filename << ":" << line_number << ": Firewall rule misformatted: " << line << std::endl;
+			return false;
+		}
+		if (rule.ttl) {
+			std::cout << filename << ":" << line_number << ": Rules with ttl can't be part of the policy: " << line << std::endl;
+			return false;
+		}
+		rules.push_back(rule);
+	}
+
+	return true;
+}
+
+#endif /* RULES_FILE_H_ */
@@ -0,0 +1,320 @@
+/*
+ * ruleset_image.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: mateusz
+ *
+ *  Precompiled ruleset image: the rules plus the prebuilt indexes of classifier.h, so the module
+ *  can come up with the whole policy without parsing and indexing it rule by rule.
+ *  Written by the userspace client ("compile" command), read by the module at init.
+ *
+ *  Layout (host byte order):
+ *  	ruleset_image_header
+ *  	ruleset_image_rule[rule_count]		rules in policy order
+ *  	index_count times:					the global index first, then one per interface
+ *  		ruleset_image_index
+ *  		uint32_t[entry_count]			index entries, as positions in the rules array
+ */
+
+#ifndef RULESET_IMAGE_H_
+#define RULESET_IMAGE_H_
+
+#include "classifier.h"
+
+#ifndef __KERNEL__
+#include <cstdint>
+#endif
+
+#define RULESET_IMAGE_MAGIC		0x53524746	// "FGRS" read as little endian
+#define RULESET_IMAGE_VERSION	2			// bump on any layout or index change
+#define RULESET_IMAGE_MAX_RULES	(1 << 24)
+#define RULESET_IMAGE_OFFSET_COUNT (FW_DIRECTION_COUNT * FW_CHAIN_COUNT * (FW_PORT_BUCKETS + 2))
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t port_buckets;
+	uint32_t rule_count;
+	uint32_t index_count;
+} ruleset_image_header;
+
+typedef struct {
+	uint32_t src_ip;
+	uint32_t src_netmask;
+	uint32_t dest_ip;
+	uint32_t dest_netmask;
+	uint16_t src_port;
+	uint16_t dest_port;
+	uint8_t proto;
+	uint8_t in_out;
+	uint8_t action;
+	uint8_t reserved;
+	char dev[DEV_NAME_LENGTH];
+} ruleset_image_rule;
+
+typedef struct {
+	char dev[DEV_NAME_LENGTH];						// "" for the global index
+	uint32_t entry_count;
+	uint32_t offsets[RULESET_IMAGE_OFFSET_COUNT];	// firewall_index chains offsets
+} ruleset_image_index;
+
+/**
+ * @brief	Size in bytes of image holding given number of rules and given indexes
+ */
+static inline size_t ruleset_image_size(unsigned int rule_count, const firewall_dispatch *fd) {
+	size_t size = sizeof(ruleset_image_header) + sizeof(ruleset_image_rule) * (size_t) rule_count +
+				  sizeof(ruleset_image_index) + sizeof(uint32_t) * (size_t) fd->global.entry_count;
+	unsigned int i;
+
+	for (i = 0; i < fd->dev_count; i++)
+		size += sizeof(ruleset_image_index) + sizeof(uint32_t) * (size_t) fd->devs[i].index.entry_count;
+	return size;
+}
+
+/**
+ * @brief	Copy interface name into a fixed size image field: zero padded, always NUL terminated,
+ * 			as the reader rejects names filling the whole field
+ */
+static inline void ruleset_image_copy_dev(char *to, const char *dev) {
+	size_t length = strnlen(dev, DEV_NAME_LENGTH - 1);
+
+	memcpy(to, dev, length);
+	memset(to + length, 0, DEV_NAME_LENGTH - length);
+}
+
+/**
+ * @brief	Serialize one index at given position
+ * @return	Position right after the index
+ */
+static inline void *ruleset_image_write_index(void *position, const char *dev, const firewall_index *idx) {
+	ruleset_image_index *image_index = (ruleset_image_index *) position;
+	uint32_t *image_entries = (uint32_t *) (image_index + 1);
+
+	ruleset_image_copy_dev(image_index->dev, dev);
+	image_index->entry_count = idx->entry_count;
+	memcpy(image_index->offsets, idx->chains, sizeof(image_index->offsets));
+	memcpy(image_entries, idx->rule, sizeof(uint32_t) * idx->entry_count);
+	return image_entries + idx->entry_count;
+}
+
+/**
+ * @brief	Serialize rules and their indexes into newly allocated image, free it with fw_free
+ * @return	Error description, or NULL on success
+ */
+static inline const char *ruleset_image_write(const firewall_rule *rules, unsigned int rule_count,
+											  const firewall_dispatch *fd, void **out_image, size_t *out_size) {
+	ruleset_image_header *header;
+	ruleset_image_rule *image_rules;
+	void *position;
+	unsigned int i;
+	size_t size;
+
+	if (rule_count > RULESET_IMAGE_MAX_RULES)
+		return "too many rules";
+
+	for (i = 0; i < rule_count; i++)
+		if (rules[i].src_port > 0xffff || rules[i].dest_port > 0xffff)
+			return "port number out of range";
+
+	size = ruleset_image_size(rule_count, fd);
+	if (!(header = (ruleset_image_header *) fw_alloc(size)))
+		return "out of memory";
+
+	memset(header, 0, size);
+	header->magic = RULESET_IMAGE_MAGIC;
+	header->version = RULESET_IMAGE_VERSION;
+	header->port_buckets = FW_PORT_BUCKETS;
+	header->rule_count = rule_count;
+	header->index_count = 1 + fd->dev_count;
+
+	image_rules = (ruleset_image_rule *) (header + 1);
+	for (i = 0; i < rule_count; i++) {
+		image_rules[i].src_ip = rules[i].src_ip;
+		image_rules[i].src_netmask = rules[i].src_netmask;
+		image_rules[i].dest_ip = rules[i].dest_ip;
+		image_rules[i].dest_netmask = rules[i].dest_netmask;
+		image_rules[i].src_port = rules[i].src_port;
+		image_rules[i].dest_port = rules[i].dest_port;
+		image_rules[i].proto = rules[i].proto;
+		image_rules[i].in_out = rules[i].in_out;
+		image_rules[i].action = rules[i].action;
+		ruleset_image_copy_dev(image_rules[i].dev, rules[i].dev);
+	}
+
+	position = ruleset_image_write_index(image_rules + rule_count, "", &fd->global);
+	for (i = 0; i < fd->dev_count; i++)
+		position = ruleset_image_write_index(position, fd->devs[i].dev, &fd->devs[i].index);
+
+	*out_image = header;
+	*out_size = size;
+	return NULL;
+}
+
+/**
+ * @brief	Validate one index of the image and unpack it; it must hold exactly the rules bound to its interface
+ * @return	Error description, or NULL on success
+ */
+static inline const char *ruleset_image_read_index(const ruleset_image_index *image_index, const firewall_rule *rules,
+												   const firewall_rule_key *keys, unsigned int rule_count, firewall_index *idx) {
+	const uint32_t *image_entries = (const uint32_t *) (image_index + 1);
+	const uint32_t *offsets = image_index->offsets;
+	unsigned int i, chain, bucket, rule, expected_entries = 0;
+
+	// chains must tile the entries array
+	if (offsets[0] != 0 || offsets[RULESET_IMAGE_OFFSET_COUNT - 1] != image_index->entry_count)
+		return "bad index offsets";
+	for (i = 1; i < RULESET_IMAGE_OFFSET_COUNT; i++)
+		if (offsets[i] < offsets[i - 1])
+			return "bad index offsets";
+	for (chain = 1; chain < FW_DIRECTION_COUNT * FW_CHAIN_COUNT; chain++)
+		if (offsets[chain * (FW_PORT_BUCKETS + 2)] != offsets[chain * (FW_PORT_BUCKETS + 2) - 1])
+			return "bad index offsets";
+
+	// with entries unique per bucket (checked below) this means no rule is missing from the index
+	for (i = 0; i < rule_count; i++)
+		if (rule_indexable(&rules[i]) && rule_on_dev(&rules[i], image_index->dev))
+			for (chain = 0; chain < FW_CHAIN_COUNT; chain++)
+				expected_entries += rule_in_chain(&rules[i], chain);
+	if (expected_entries != image_index->entry_count)
+		return "index doesn't cover all rules";
+
+	memset(idx, 0, sizeof(*idx));
+	if (!firewall_index_alloc(idx, image_index->entry_count))
+		return "out of memory";
+	memcpy(idx->chains, offsets, sizeof(idx->chains));
+
+	// every entry must sit in its rule's chain and bucket, in policy order, or lookups would go wrong
+	for (chain = 0; chain < FW_DIRECTION_COUNT * FW_CHAIN_COUNT; chain++)
+		for (bucket = 0; bucket <= FW_WILD_BUCKET; bucket++)
+			for (i = offsets[chain * (FW_PORT_BUCKETS + 2) + bucket]; i < offsets[chain * (FW_PORT_BUCKETS + 2) + bucket + 1]; i++) {
+				rule = image_entries[i];
+				if (rule >= rule_count ||
+					!rule_on_dev(&rules[rule], image_index->dev) ||
+					direction_slot(rules[rule].in_out) != (int) (chain / FW_CHAIN_COUNT) ||
+					!rule_in_chain(&rules[rule], chain % FW_CHAIN_COUNT) ||
+					port_bucket(rules[rule].dest_port) != bucket ||
+					(i > offsets[chain * (FW_PORT_BUCKETS + 2) + bucket] && rule <= idx->rule[i - 1])) {
+					firewall_index_free(idx);
+					return "bad index entry";
+				}
+				firewall_index_set_entry(idx, i, rule, &keys[rule]);
+			}
+
+	return NULL;
+}
+
+/**
+ * @brief	Validate image and unpack it into rules array and ready to use dispatch, interfaces unresolved.
+ * 			On success free rules with fw_free and dispatch with firewall_dispatch_free
+ * @return	Error description, or NULL on success
+ */
+static inline const char *ruleset_image_read(const void *image, size_t size,
+											 firewall_rule **out_rules, unsigned int *out_rule_count, firewall_dispatch *fd) {
+	const ruleset_image_header *header = (const ruleset_image_header *) image;
+	const ruleset_image_rule *image_rules;
+	const ruleset_image_index *image_index;
+	const char *position, *end = (const char *) image + size, *error = NULL;
+	firewall_index *idx;
+	firewall_rule *rules;
+	unsigned int i, j;
+
+	if (size < sizeof(*header))
+		return "image too small";
+	if (header->magic != RULESET_IMAGE_MAGIC)
+		return "bad magic, not a ruleset image or built on other endian machine";
+	if (header->version != RULESET_IMAGE_VERSION)
+		return "unsupported image version";
+	if (header->port_buckets != FW_PORT_BUCKETS)
+		return "image built with different index layout";
+	if (header->rule_count > RULESET_IMAGE_MAX_RULES || header->index_count < 1 || header->index_count > header->rule_count + 1)
+		return "bad rule count";
+	if ((size - sizeof(*header)) / sizeof(ruleset_image_rule) < header->rule_count)
+		return "image size doesn't match its header";
+
+	image_rules = (const ruleset_image_rule *) (header + 1);
+	rules = (firewall_rule *) fw_alloc(sizeof(firewall_rule) * (header->rule_count ? header->rule_count : 1));
+	if (!rules)
+		return "out of memory";
+
+	for (i = 0; i < header->rule_count; i++) {
+		if (image_rules[i].in_out > DIRECTION_OUTGOING || image_rules[i].action > ACTION_UNBLOCK ||
+			(image_rules[i].proto != PROTOCOL_ALL && image_rules[i].proto != PROTOCOL_TCP && image_rules[i].proto != PROTOCOL_UDP) ||
+			image_rules[i].dev[DEV_NAME_LENGTH - 1] != '\0') {
+			fw_free(rules);
+			return "bad rule";
+		}
+		rules[i].src_ip = image_rules[i].src_ip;
+		rules[i].src_netmask = image_rules[i].src_netmask;
+		rules[i].dest_ip = image_rules[i].dest_ip;
+		rules[i].dest_netmask = image_rules[i].dest_netmask;
+		rules[i].src_port = image_rules[i].src_port;
+		rules[i].dest_port = image_rules[i].dest_port;
+		rules[i].proto = (protocol_type) image_rules[i].proto;
+		rules[i].in_out = (packet_direction) image_rules[i].in_out;
+		rules[i].action = (action_type) image_rules[i].action;
+		rules[i].ttl = 0;
+		memcpy(rules[i].dev, image_rules[i].dev, DEV_NAME_LENGTH);
+	}
+
+	if (!firewall_dispatch_alloc(fd, header->rule_count, header->index_count - 1)) {
+		fw_free(rules);
+		return "out of memory";
+	}
+	for (i = 0; i < header->rule_count; i++)
+		rule_key_pack(&rules[i], &fd->keys[i]);
+
+	// the global index first, then one index per distinct interface
+	position = (const char *) (image_rules + header->rule_count);
+	for (i = 0; i < header->index_count && !error; i++) {
+		image_index = (const ruleset_image_index *) position;
+		if ((size_t) (end - position) < sizeof(*image_index) ||
+			(size_t) (end - position - sizeof(*image_index)) / sizeof(uint32_t) < image_index->entry_count) {
+			error = "image size doesn't match its header";
+			break;
+		}
+		position += sizeof(*image_index) + sizeof(uint32_t) * (size_t) image_index->entry_count;
+
+		if (image_index->dev[DEV_NAME_LENGTH - 1] != '\0' || (i == 0) != (image_index->dev[0] == '\0'))
+			error = "bad index interface";
+		for (j = 0; j < fd->dev_count && !error; j++)
+			if (strncmp(fd->devs[j].dev, image_index->dev, DEV_NAME_LENGTH) == 0)
+				error = "bad index interface";
+		if (error)
+			break;
+
+		if (i == 0) {
+			idx = &fd->global;
+		} else {
+			memcpy(fd->devs[i - 1].dev, image_index->dev, DEV_NAME_LENGTH);
+			idx = &fd->devs[i - 1].index;
+		}
+		error = ruleset_image_read_index(image_index, rules, fd->keys, header->rule_count, idx);
+		if (!error && i > 0)
+			fd->dev_count++;
+	}
+
+	if (!error && position != end)
+		error = "image size doesn't match its header";
+
+	// every interface a rule is bound to must have its index
+	for (i = 0; i < header->rule_count && !error; i++) {
+		if (!rules[i].dev[0])
+			continue;
+		for (j = 0; j < fd->dev_count && !rule_on_dev(&rules[i], fd->devs[j].dev); j++)
+			;
+		if (j == fd->dev_count)
+			error = "index doesn't cover all rules";
+	}
+
+	if (error) {
+		firewall_dispatch_free(fd);
+		fw_free(rules);
+		return error;
+	}
+
+	*out_rules = rules;
+	*out_rule_count = header->rule_count;
+	return NULL;
+}
+
+#endif /* RULESET_IMAGE_H_ */
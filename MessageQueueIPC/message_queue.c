@@ -11,60 +11,704 @@
 #include <linux/kernel.h>           // Contains types, macros, functions for the kernel
 #include <linux/fs.h>               // Header for the Linux file system support
 #include <linux/slab.h>             // kmalloc
-#include <linux/completion.h>
+#include <linux/vmalloc.h>          // vmalloc_user
+#include <linux/mm.h>               // remap_vmalloc_range
+#include <linux/wait.h>
+#include <linux/percpu-rwsem.h>
 #include <linux/mutex.h>
+#include <linux/uio.h>              // iov_iter
+#include <linux/pipe_fs_i.h>        // pipe size for splice
+#include <linux/poll.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
+#include <linux/log2.h>             // roundup_pow_of_two
+#include <linux/bitops.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
 #include <asm/uaccess.h>            // Required for the copy to user function
+#include "mq_ring.h"
 
 MODULE_LICENSE("GPL");              // The license type -- this affects available functionality
 MODULE_AUTHOR("Mateusz Midor");     // The author -- visible when you use modinfo
 MODULE_DESCRIPTION("A simple Linux IPC message queue"); // The description -- see modinfo
 MODULE_VERSION("0.1");              // A version number to inform users
 
-#define  DEVICE_NAME "message_queue"    // The device will appear at /dev/char_dev_example using this value
+#define  DEVICE_NAME "message_queue"    // The devices will appear at /dev/message_queue0, /dev/message_queue1...
 #define  CLASS_NAME  "message_queue"    // The device class -- this is a character device driver
+#define  MAX_QUEUE_COUNT 256            // register_chrdev reserves this many minor numbers
+#define  MAX_MSG_SIZE (1 << 20)
+#define  MAX_RING_SIZE (1 << 30)        // largest ring a queue may allocate, header and slots
+
+// number of independent queues, each one is a separate minor device
+static unsigned int queue_count = 1;
+module_param(queue_count, uint, S_IRUGO);
+MODULE_PARM_DESC(queue_count, "Number of queues, /dev/message_queue0 .. /dev/message_queue<queue_count - 1>");
+
+// max message length; longer writes are truncated, longer framed records rejected
+static unsigned int msg_size = MQ_MESSAGE_SIZE;
+module_param(msg_size, uint, S_IRUGO);
+MODULE_PARM_DESC(msg_size, "Max message length in bytes");
+
+// message limit of a queue, can be changed per queue with MQ_IOC_RESIZE
+static unsigned int default_capacity = 8;
+module_param_named(capacity, default_capacity, uint, S_IRUGO);
+MODULE_PARM_DESC(capacity, "Initial max number of messages on each queue, rounded up to a power of 2");
+
+// number of message priorities; each has its own ring of capacity messages
+static unsigned int priorities = 4;
+module_param(priorities, uint, S_IRUGO);
+MODULE_PARM_DESC(priorities, "Number of message priorities, 0 (default) .. priorities - 1; higher are read first");
+
+// broadcast queues give every message to every open file instead of to one reader
+static bool broadcast[MAX_QUEUE_COUNT];
+module_param_array(broadcast, bool, NULL, S_IRUGO);
+MODULE_PARM_DESC(broadcast, "Per queue flags, e.g. broadcast=0,1: queue 1 is broadcast, every open file reads every message");
+
+// sharded queues trade FIFO order for scaling: a ring per cpu, written by the local cpu, read locally first
+static bool sharded[MAX_QUEUE_COUNT];
+module_param_array(sharded, bool, NULL, S_IRUGO);
+MODULE_PARM_DESC(sharded, "Per queue flags, e.g. sharded=1: queue 0 has a ring per cpu, readers steal from other cpus when theirs is empty");
+
+// byte limit of a queue, 0 for none; a message is taken while the queue holds less than this
+static unsigned int max_bytes = 0;
+module_param(max_bytes, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(max_bytes, "Max bytes of messages on each queue, split evenly between the cpus of sharded queues, 0 for no limit");
+
+static u32 slot_size;                   // ring slot size for msg_size messages
 
 static int majorNumber;                 // Major number for the device; to be assigned dynamically
 static struct class* _class = NULL;     // The device-driver class struct pointer
-static struct device* _device = NULL;   // The device-driver device struct pointer
 
 // Device operation forward declarations
 static int dev_open(struct inode *, struct file *);
 static int dev_release(struct inode *, struct file *);
-static ssize_t dev_read(struct file *, char *, size_t, loff_t *);
-static ssize_t dev_write(struct file *, const char *, size_t, loff_t *);
+static ssize_t dev_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t dev_write_iter(struct kiocb *, struct iov_iter *);
+static ssize_t dev_splice_write(struct pipe_inode_info *, struct file *, loff_t *, size_t, unsigned int);
+static unsigned int dev_poll(struct file *, poll_table *);
+static long dev_ioctl(struct file *, unsigned int, unsigned long);
+static int dev_mmap(struct file *, struct vm_area_struct *);
 
 // File operations of device
 static struct file_operations fops = {
+        .owner = THIS_MODULE,   // open files and mappings use queues[] and mq_vm_ops, so they pin the module
         .open = dev_open,
-        .read = dev_read,
-        .write = dev_write,
+        .read_iter = dev_read_iter,
+        .write_iter = dev_write_iter,
+        .poll = dev_poll,
+        .unlocked_ioctl = dev_ioctl,
+        .mmap = dev_mmap,
+        .splice_read = generic_file_splice_read,    // pipe <-> queue through read_iter/write_iter, no user buffer
+        .splice_write = dev_splice_write,
         .release = dev_release,
 };
 
-bool read_done = false; // after message has been read this is set to true so next read returns length 0 - end of data
+// counters of a queue, per cpu so the hot path updates only local memory; sysfs shows their sums
+struct message_queue_stats {
+    u64 enqueues;
+    u64 dequeues;           // on broadcast queues: deliveries to subscribers
+    u64 enqueued_bytes;
+    u64 dequeued_bytes;
+    u64 blocked_readers;    // reads that had to wait for a message
+    u64 blocked_writers;    // writes that had to wait for space
+    u64 read_wait_ns;       // time readers spent waiting on queue_not_empty
+    u64 write_wait_ns;      // time writers spent waiting on queue_not_full
+    u64 steals;             // dequeues of sharded queues from other cpus' rings
+};
+
+// rings of one cpu of a sharded queue, one per priority; other queues have a single shard
+struct message_queue_shard {
+    unsigned long levels_ready; // bitmap of levels that may have messages, so read finds the highest in O(1)
+    atomic_t messages;          // messages read/write moved onto the rings and not yet off them
+    u32 high_water;             // max of messages seen by writers
+    atomic_long_t bytes;        // message bytes of those messages
+} ____cacheline_aligned_in_smp;
+
+// queue with all its state; queues share nothing, so applications using different queues don't contend
+struct message_queue {
+    // lock-free rings of preallocated slots, one per priority of each shard, level_size bytes apart; messages are
+    // copied straight in and out of them; user space can mmap them. Replaced on resize: waiters look at them under
+    // rcu, read/write hold resize_sem for reading
+    struct mq_ring __rcu *ring;
+    u32 capacity;           // power of 2, of each ring
+    size_t level_size;
+    size_t ring_size;       // of all the rings
+    struct message_queue_shard *shards;
+    u32 shard_count;        // nr_cpu_ids if sharded, 1 otherwise
+    struct percpu_rw_semaphore resize_sem; // read side is per cpu, so readers and writers share no lock cache line
+    atomic_t mapped;        // number of mappings; while mapped user space owns the ring and read/write fail
+    bool ring_dirty;        // ring was mapped; repair and recount it before read/write use it again
+    u32 map_generation;     // mmaps done so far
+    spinlock_t ring_lock;   // orders mmap against resize: taking a mapping and swapping the ring
+
+    // accounting of messages moved by read/write; what is on the queue is counted per shard
+    struct message_queue_stats __percpu *stats;
+
+    // for blocking user space program when writing to full queue or reading from empty queue
+    wait_queue_head_t queue_not_empty;
+    wait_queue_head_t queue_not_full;
+
+    // broadcast queue: the level 0 ring holds the last capacity messages and every open file reads them through its
+    // own cursor; writers never wait, they overwrite the oldest message. Not resized nor mapped, so the ring stays
+    bool broadcast;
+    struct mutex broadcast_mutex;   // serializes writers, so the ring order is the publish order
+
+    struct device *device;
+};
+
+// single open file of a queue
+struct message_queue_file {
+    struct message_queue *queue;
+    bool read_done; // after message has been read this is set to true so next read returns length 0 - end of data
+    bool framed;    // read/write carry any number of [__u32 length][data] records instead of single raw message
+    u32 priority;   // of messages written
+
+    // broadcast queue subscriber
+    struct mutex lock;      // for threads reading the same file
+    u32 cursor;             // position of the next message to read
+    u64 dropped;            // messages overwritten before they were read
+};
+
+static struct message_queue *queues = NULL;
+
+/**
+ * @brief   Bytes taken by the ring of one priority, page aligned
+ */
+static size_t level_size(u32 capacity) {
+    return PAGE_ALIGN(mq_ring_size(capacity, slot_size));
+}
+
+/**
+ * @brief   Ring of given priority
+ */
+static struct mq_ring *level_ring(struct mq_ring *ring, u32 level, size_t size) {
+    return (struct mq_ring *)((char *)ring + level * size);
+}
+
+/**
+ * @brief   Ring of given priority in given shard
+ */
+static struct mq_ring *shard_ring(struct message_queue *queue, struct mq_ring *ring, u32 shard, u32 priority) {
+    return level_ring(ring, shard * priorities + priority, queue->level_size);
+}
+
+/**
+ * @brief   Shard of the running cpu; a task moved to other cpu meanwhile just uses a remote shard for a while
+ */
+static u32 local_shard(struct message_queue *queue) {
+    return queue->shard_count == 1 ? 0 : raw_smp_processor_id() % queue->shard_count;
+}
+
+/**
+ * @brief   Ring capacity for requested number of messages: next power of 2, so free running positions wrap cleanly
+ * @return  Capacity, 0 if the rings of all shards don't fit the ring size limit
+ */
+static u32 ring_capacity(unsigned long messages, u32 shards) {
+    if (messages < 1 || messages > MAX_RING_SIZE / slot_size / priorities / shards)
+        return 0;
+    messages = roundup_pow_of_two(messages);
+    return (size_t)shards * priorities * level_size(messages) <= MAX_RING_SIZE ? messages : 0;
+}
+
+/**
+ * @brief   Allocate empty rings for capacity messages of each priority of each shard; size is set to their total size
+ * @return  Level 0 ring, NULL if out of memory
+ */
+static struct mq_ring *alloc_ring(u32 capacity, u32 shards, size_t *size) {
+    struct mq_ring *ring, *level;
+    u32 i;
+
+    *size = shards * priorities * level_size(capacity);
+    ring = vmalloc_user(*size);
+    if (!ring)
+        return NULL;
+    for (i = 0; i < shards * priorities; i++) {
+        level = level_ring(ring, i, level_size(capacity));
+        level->magic = MQ_RING_MAGIC;
+        level->capacity = capacity;
+        level->message_size = msg_size;
+        level->slot_size = slot_size;
+        level->levels = priorities;
+        level->level_size = level_size(capacity);
+        mq_ring_reset(level, capacity - 1, slot_size);
+    }
+    return ring;
+}
+
+/**
+ * @brief   Initialize empty queue
+ * @return  0 on success
+ */
+static int init_message_queue(struct message_queue *queue, bool is_broadcast, bool is_sharded) {
+    int ret;
+
+    queue->shard_count = is_sharded ? nr_cpu_ids : 1;
+    // broadcast readers tell a message from one overwriting it by slot sequence numbers, which needs 2 slots at least
+    queue->capacity = ring_capacity(is_broadcast ? max(default_capacity, 2u) : default_capacity, queue->shard_count);
+    if (!queue->capacity)
+        return -EINVAL; // rings of all the cpus don't fit MAX_RING_SIZE
+
+    queue->shards = kcalloc(queue->shard_count, sizeof(*queue->shards), GFP_KERNEL);
+    if (!queue->shards)
+        return -ENOMEM;
+    queue->stats = alloc_percpu(struct message_queue_stats);
+    if (!queue->stats) {
+        kfree(queue->shards);
+        return -ENOMEM;
+    }
+    ret = percpu_init_rwsem(&queue->resize_sem);
+    if (ret) {
+        free_percpu(queue->stats);
+        kfree(queue->shards);
+        return ret;
+    }
+
+    queue->ring = alloc_ring(queue->capacity, queue->shard_count, &queue->ring_size);
+    if (!queue->ring) {
+        percpu_free_rwsem(&queue->resize_sem);
+        free_percpu(queue->stats);
+        kfree(queue->shards);
+        return -ENOMEM;
+    }
+    queue->level_size = level_size(queue->capacity);
+    atomic_set(&queue->mapped, 0);
+    queue->ring_dirty = false;
+    queue->map_generation = 0;
+    spin_lock_init(&queue->ring_lock);
+    init_waitqueue_head(&queue->queue_not_empty);
+    init_waitqueue_head(&queue->queue_not_full);
+    queue->broadcast = is_broadcast;
+    mutex_init(&queue->broadcast_mutex);
+    return 0;
+}
+
+/**
+ * @brief   Ring of the queue, for read/write holding resize_sem
+ */
+static struct mq_ring *locked_ring(struct message_queue *queue) {
+    return rcu_dereference_protected(queue->ring, percpu_rwsem_is_held(&queue->resize_sem));
+}
+
+/**
+ * @brief   Ring of a broadcast queue, never replaced
+ */
+static struct mq_ring *broadcast_ring(struct message_queue *queue) {
+    return rcu_dereference_protected(queue->ring, queue->broadcast);
+}
+
+/**
+ * @brief   Ring of the queue and mask to index it with, for waiters under rcu_read_lock. Resize publishes a smaller
+ *          capacity before its ring and a larger one after it, so the smaller of the two seen around the ring fits it.
+ *          Level rings found with that capacity may be wrong for the moment of the resize, but are inside the memory
+ */
+static struct mq_ring *rcu_ring(struct message_queue *queue, u32 *mask) {
+    u32 capacity = READ_ONCE(queue->capacity);
+    struct mq_ring *ring;
+
+    smp_rmb();
+    ring = rcu_dereference(queue->ring);
+    smp_rmb();
+    *mask = min(capacity, READ_ONCE(queue->capacity)) - 1;
+    return ring;
+}
+
+/**
+ * @brief   Number of messages on the queue, including ones still being written or read
+ */
+static u32 message_count(struct message_queue *queue) {
+    struct mq_ring *ring, *level;
+    u32 count = 0, mask, i;
+
+    rcu_read_lock();
+    ring = rcu_ring(queue, &mask);
+    for (i = 0; i < queue->shard_count * priorities; i++) {
+        level = level_ring(ring, i, level_size(mask + 1));
+        count += min(READ_ONCE(level->tail) - READ_ONCE(level->head), mask + 1); // user space may have left them anything
+    }
+    rcu_read_unlock();
+    return count;
+}
+
+/**
+ * @brief   Next message of some priority is filled. Looks at the rings rather than levels_ready,
+ *          which mmap users don't keep
+ */
+static bool message_ready(struct message_queue *queue) {
+    struct mq_ring *ring;
+    bool ready = false;
+    u32 mask, i;
+
+    rcu_read_lock();
+    ring = rcu_ring(queue, &mask);
+    for (i = 0; i < queue->shard_count * priorities && !ready; i++)
+        ready = mq_ring_readable(level_ring(ring, i, level_size(mask + 1)), mask, slot_size);
+    rcu_read_unlock();
+    return ready;
+}
+
+/**
+ * @brief   Next slot of the priority ring of some shard is free
+ */
+static bool slot_free(struct message_queue *queue, u32 priority) {
+    struct mq_ring *ring;
+    bool free = false;
+    u32 mask, i;
+
+    rcu_read_lock();
+    ring = rcu_ring(queue, &mask);
+    for (i = 0; i < queue->shard_count && !free; i++)
+        free = mq_ring_writable(level_ring(ring, i * priorities + priority, level_size(mask + 1)), mask, slot_size);
+    rcu_read_unlock();
+    return free;
+}
+
+/**
+ * @brief   Shard is under its share of the byte limit
+ */
+static bool shard_under_limit(struct message_queue *queue, u32 shard) {
+    unsigned int limit = READ_ONCE(max_bytes);
+
+    return !limit || atomic_long_read(&queue->shards[shard].bytes) < DIV_ROUND_UP(limit, queue->shard_count);
+}
+
+/**
+ * @brief   Shard can take a message of the priority: has a free slot for it and is under its share of the byte limit
+ */
+static bool shard_has_space(struct message_queue *queue, u32 shard, u32 priority) {
+    struct mq_ring *ring;
+    bool free;
+    u32 mask;
+
+    rcu_read_lock();
+    ring = rcu_ring(queue, &mask);
+    free = mq_ring_writable(level_ring(ring, shard * priorities + priority, level_size(mask + 1)), mask, slot_size);
+    rcu_read_unlock();
+    return free && shard_under_limit(queue, shard);
+}
+
+/**
+ * @brief   Queue can take a message of the priority in some shard
+ */
+static bool message_queue_has_space(struct message_queue *queue, u32 priority) {
+    u32 shard;
+
+    for (shard = 0; shard < queue->shard_count; shard++)
+        if (shard_has_space(queue, shard, priority))
+            return true;
+    return false;
+}
+
+/**
+ * @brief   Make a priority ring consistent again after it was mapped: user space may have left
+ *          head, tail and slot sequence numbers anything
+ * @return  Message bytes on the ring
+ */
+static long repair_level(struct message_queue *queue, struct mq_ring *ring, u32 *messages) {
+    u32 mask = queue->capacity - 1;
+    u32 head, count, i, len;
+    long bytes = 0;
+
+    head = READ_ONCE(ring->head);
+    count = READ_ONCE(ring->tail) - head;
+    if (count > queue->capacity) {
+        printk(KERN_WARNING "message_queue%u: ring left corrupt by user space, emptied\n", MINOR(queue->device->devt));
+        mq_ring_reset(ring, mask, slot_size);
+        head = count = 0;
+    }
+
+    // slots from head to tail hold messages of this lap, the rest are free
+    for (i = 0; i <= mask; i++) {
+        struct mq_slot *slot = mq_ring_slot(ring, head + i, mask, slot_size);
+
+        slot->seq = i < count ? head + i + 1 : head + i;
+        len = READ_ONCE(slot->len);
+        if (i < count && len != MQ_SLOT_SKIP)
+            bytes += min_t(u32, len, msg_size);
+    }
+    *messages = count;
+    return bytes;
+}
+
+/**
+ * @brief   After the rings were mapped, make them consistent again and recount their bytes and non-empty levels.
+ *          Called with resize_sem held for writing, when not mapped
+ */
+static void repair_ring(struct message_queue *queue) {
+    struct mq_ring *ring = locked_ring(queue);
+    unsigned long levels_ready;
+    long bytes;
+    u32 shard, i, count, messages;
+
+    spin_lock(&queue->ring_lock);
+    queue->ring_dirty = false;
+    spin_unlock(&queue->ring_lock);
+
+    for (shard = 0; shard < queue->shard_count; shard++) {
+        levels_ready = 0;
+        messages = 0;
+        bytes = 0;
+        for (i = 0; i < priorities; i++) {
+            bytes += repair_level(queue, shard_ring(queue, ring, shard, i), &count);
+            if (count)
+                __set_bit(i, &levels_ready);
+            messages += count;
+        }
+        WRITE_ONCE(queue->shards[shard].levels_ready, levels_ready);
+        atomic_set(&queue->shards[shard].messages, messages);
+        atomic_long_set(&queue->shards[shard].bytes, bytes);
+    }
+}
+
+/**
+ * @brief   Repair the ring if it was mapped since read/write last used it
+ */
+static void check_message_queue(struct message_queue *queue) {
+    if (!READ_ONCE(queue->ring_dirty))
+        return;
+
+    percpu_down_write(&queue->resize_sem);
+    if (queue->ring_dirty && !atomic_read(&queue->mapped))
+        repair_ring(queue);
+    percpu_up_write(&queue->resize_sem);
+}
+
+/**
+ * @brief   Queue can be read: has messages, or read should fail as the ring is mapped
+ */
+static bool message_queue_readable(struct message_queue *queue) {
+    return atomic_read(&queue->mapped) || message_ready(queue);
+}
+
+/**
+ * @brief   Queue can be written at the priority: has free slots, or write should fail as the ring is mapped
+ */
+static bool message_queue_writable(struct message_queue *queue, u32 priority) {
+    return atomic_read(&queue->mapped) || message_queue_has_space(queue, priority);
+}
+
+/**
+ * @brief   Replace the queue ring with one for messages (rounded up to a power of 2), keeping the queued messages
+ * @return  0 on success
+ */
+static int resize_message_queue(struct message_queue *queue, unsigned long messages) {
+    u32 capacity = ring_capacity(messages, queue->shard_count);
+    struct mq_ring *ring, *old, *from, *to;
+    struct mq_slot *slot;
+    size_t size;
+    u32 head, count, i, level, generation;
+    int ret = 0;
+
+    if (!capacity)
+        return -EINVAL;
+
+    ring = alloc_ring(capacity, queue->shard_count, &size);
+    if (!ring)
+        return -ENOMEM;
+
+    // waits out read/write in progress and keeps new ones off the ring
+    percpu_down_write(&queue->resize_sem);
+    spin_lock(&queue->ring_lock);
+    generation = queue->map_generation;
+    if (atomic_read(&queue->mapped))
+        ret = -EBUSY;
+    spin_unlock(&queue->ring_lock);
+    if (ret)
+        goto fail;
+
+    if (queue->ring_dirty)
+        repair_ring(queue);
+    old = locked_ring(queue);
+    for (level = 0; level < queue->shard_count * priorities; level++) {
+        from = level_ring(old, level, queue->level_size);
+        if (from->tail - from->head > capacity) {
+            ret = -ENOSPC;
+            goto fail;
+        }
+    }
+
+    // move the messages oldest first; if the ring got mapped meanwhile the copy may be stale, so give up
+    for (level = 0; level < queue->shard_count * priorities; level++) {
+        from = level_ring(old, level, queue->level_size);
+        to = level_ring(ring, level, level_size(capacity));
+        head = from->head;
+        count = from->tail - head;
+        for (i = 0; i < count; i++) {
+            slot = mq_ring_slot(to, i, capacity - 1, slot_size);
+            memcpy(slot, mq_ring_slot(from, head + i, queue->capacity - 1, slot_size), slot_size);
+            slot->seq = i + 1;
+        }
+        to->tail = count;
+    }
+
+    spin_lock(&queue->ring_lock);
+    if (queue->map_generation != generation)
+        ret = -EBUSY;
+    else {
+        if (capacity < queue->capacity)
+            WRITE_ONCE(queue->capacity, capacity); // ordered before the ring by rcu_assign_pointer
+        rcu_assign_pointer(queue->ring, ring);
+        smp_wmb();
+        WRITE_ONCE(queue->capacity, capacity);
+        queue->level_size = level_size(capacity);
+        queue->ring_size = size;
+    }
+    spin_unlock(&queue->ring_lock);
+    if (ret)
+        goto fail;
+    percpu_up_write(&queue->resize_sem);
+
+    synchronize_rcu(); // waiters may still look at the old ring
+    vfree(old);
+
+    printk(KERN_INFO "message_queue%u: capacity %u\n", MINOR(queue->device->devt), capacity);
+    wake_up_interruptible(&queue->queue_not_empty);
+    wake_up_interruptible(&queue->queue_not_full);
+    return 0;
+
+fail:
+    percpu_up_write(&queue->resize_sem);
+    vfree(ring);
+    return ret;
+}
+
+/**
+ * @brief   sysfs /sys/class/message_queue/message_queue<N>/ attributes of the queue
+ */
+static ssize_t capacity_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct message_queue *queue = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%u\n", READ_ONCE(queue->capacity));
+}
+
+static ssize_t depth_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct message_queue *queue = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%u\n", message_count(queue));
+}
+
+static ssize_t high_water_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct message_queue *queue = dev_get_drvdata(dev);
+    u32 high_water = 0, shard;
+
+    for (shard = 0; shard < queue->shard_count; shard++)
+        high_water = max(high_water, READ_ONCE(queue->shards[shard].high_water));
+    return sprintf(buf, "%u\n", high_water);
+}
+
+static ssize_t bytes_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct message_queue *queue = dev_get_drvdata(dev);
+    long bytes = 0;
+    u32 shard;
+
+    for (shard = 0; shard < queue->shard_count; shard++)
+        bytes += atomic_long_read(&queue->shards[shard].bytes);
+    return sprintf(buf, "%ld\n", bytes);
+}
+
+static ssize_t memory_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct message_queue *queue = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%zu\n", READ_ONCE(queue->ring_size));
+}
+
+/**
+ * @brief   Sum of a counter over all cpus; offset is the counter offset in struct message_queue_stats
+ */
+static u64 queue_stat(struct message_queue *queue, size_t offset) {
+    u64 sum = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        sum += *(u64 *)((char *)per_cpu_ptr(queue->stats, cpu) + offset);
+    return sum;
+}
+
+/**
+ * @brief   Counters of each cpu: a line of "cpu enqueues dequeues steals"; on sharded queues a cpu is a shard
+ */
+static ssize_t shards_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct message_queue *queue = dev_get_drvdata(dev);
+    struct message_queue_stats *stats;
+    ssize_t len = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        stats = per_cpu_ptr(queue->stats, cpu);
+        len += scnprintf(buf + len, PAGE_SIZE - len, "%d %llu %llu %llu\n", cpu, READ_ONCE(stats->enqueues),
+                         READ_ONCE(stats->dequeues), READ_ONCE(stats->steals));
+    }
+    return len;
+}
+
+#define QUEUE_STAT_ATTR(counter)                                                                            \
+static ssize_t counter##_show(struct device *dev, struct device_attribute *attr, char *buf) {              \
+    return sprintf(buf, "%llu\n", queue_stat(dev_get_drvdata(dev), offsetof(struct message_queue_stats, counter))); \
+}                                                                                                           \
+static DEVICE_ATTR_RO(counter)
+
+static DEVICE_ATTR_RO(capacity);
+static DEVICE_ATTR_RO(depth);           // messages on the queue
+static DEVICE_ATTR_RO(high_water);      // max messages on the queue seen, on sharded queues on its fullest shard
+static DEVICE_ATTR_RO(bytes);           // message bytes on the queue
+static DEVICE_ATTR_RO(memory);          // bytes allocated for the ring
+
+static struct attribute *message_queue_attrs[] = {
+        &dev_attr_capacity.attr,
+        &dev_attr_depth.attr,
+        &dev_attr_high_water.attr,
+        &dev_attr_bytes.attr,
+        &dev_attr_memory.attr,
+        NULL,
+};
+
+// /sys/class/message_queue/message_queue<N>/stats/
+QUEUE_STAT_ATTR(enqueues);
+QUEUE_STAT_ATTR(dequeues);
+QUEUE_STAT_ATTR(enqueued_bytes);
+QUEUE_STAT_ATTR(dequeued_bytes);
+QUEUE_STAT_ATTR(blocked_readers);
+QUEUE_STAT_ATTR(blocked_writers);
+QUEUE_STAT_ATTR(read_wait_ns);
+QUEUE_STAT_ATTR(write_wait_ns);
+QUEUE_STAT_ATTR(steals);
+static DEVICE_ATTR_RO(shards);
 
-// define message queue itself
-LIST_HEAD(message_queue);
-struct message {
-    struct list_head list;
-    char data[256];
+static struct attribute *message_queue_stats_attrs[] = {
+        &dev_attr_enqueues.attr,
+        &dev_attr_dequeues.attr,
+        &dev_attr_enqueued_bytes.attr,
+        &dev_attr_dequeued_bytes.attr,
+        &dev_attr_blocked_readers.attr,
+        &dev_attr_blocked_writers.attr,
+        &dev_attr_read_wait_ns.attr,
+        &dev_attr_write_wait_ns.attr,
+        &dev_attr_steals.attr,
+        &dev_attr_shards.attr,
+        NULL,
 };
 
-// message counter and limit
-size_t message_count = 0;
-#define MAX_MESSAGE_COUNT 5
+static const struct attribute_group message_queue_group = {
+        .attrs = message_queue_attrs,
+};
 
-// for blocking user space program when writing to full queue or reading from empty queue
-static DECLARE_COMPLETION(queue_not_empty);
-static DECLARE_COMPLETION(queue_not_full);
+static const struct attribute_group message_queue_stats_group = {
+        .name = "stats",
+        .attrs = message_queue_stats_attrs,
+};
 
-// for synchronizim message_queue access
-static DEFINE_MUTEX(message_queue_mutex);
+static const struct attribute_group *message_queue_groups[] = {
+        &message_queue_group,
+        &message_queue_stats_group,
+        NULL,
+};
 
 /**
- * @brief   Register /dev/message_queue character device
+ * @brief   Register /dev/message_queue<N> character devices, one per queue
  */
 static int register_message_queue_dev(void) {
+    unsigned int i;
+    int ret;
+
     // Try to dynamically allocate a major number for the device -- more difficult but worth it
     majorNumber = register_chrdev(0, DEVICE_NAME, &fops);
     if (majorNumber < 0) {
@@ -83,23 +727,32 @@ static int register_message_queue_dev(void) {
     }
     printk(KERN_INFO "message_queue: device class registered correctly\n");
 
-    // Register the device driver
-    _device = device_create(_class, NULL, MKDEV(majorNumber, 0), NULL, DEVICE_NAME);
-    if (IS_ERR(_device)) {               // Clean up if there is an error
-        class_destroy(_class); // Repeated code but the alternative is goto statements
-        unregister_chrdev(majorNumber, DEVICE_NAME);
-        printk(KERN_ALERT "Failed to create the device\n");
-        return PTR_ERR(_device);
+    // Register the device driver, minor number is the queue number
+    for (i = 0; i < queue_count; i++) {
+        queues[i].device = device_create_with_groups(_class, NULL, MKDEV(majorNumber, i), &queues[i], message_queue_groups,
+                                                     DEVICE_NAME "%u", i);
+        if (IS_ERR(queues[i].device)) {               // Clean up if there is an error
+            ret = PTR_ERR(queues[i].device);
+            while (i--)
+                device_destroy(_class, MKDEV(majorNumber, i));
+            class_destroy(_class);
+            unregister_chrdev(majorNumber, DEVICE_NAME);
+            printk(KERN_ALERT "Failed to create the device\n");
+            return ret;
+        }
     }
-    printk(KERN_INFO "message_queue: device class created correctly\n"); // Made it! device was initialized
+    printk(KERN_INFO "message_queue: %u devices created correctly\n", queue_count); // Made it! device was initialized
     return 0;
 }
 
 /**
- * @brief   Unregister /dev/message_queue character device
+ * @brief   Unregister /dev/message_queue<N> character devices
  */
 static void unregister_message_queue_dev(void) {
-    device_destroy(_class, MKDEV(majorNumber, 0));      // remove the device
+    unsigned int i;
+
+    for (i = 0; i < queue_count; i++)
+        device_destroy(_class, MKDEV(majorNumber, i));  // remove the device
     class_unregister(_class);                           // unregister the device class
     class_destroy(_class);                              // remove the device class
     unregister_chrdev(majorNumber, DEVICE_NAME);        // unregister the major number
@@ -108,134 +761,797 @@ static void unregister_message_queue_dev(void) {
 /**
  * @brief   Release message queue memory back to the kernel
  */
-static void clean_message_queue(void) {
-    struct message *entry;
-
-    while (!list_empty(&message_queue)) {
-        entry = list_first_entry(&message_queue, struct message, list);
-        printk(KERN_INFO "freeing %s", entry->data);
-        list_del(&entry->list);
-        kfree(entry);
-    }
+static void clean_message_queue(struct message_queue *queue) {
+    vfree(queue->ring);
+    percpu_free_rwsem(&queue->resize_sem);
+    free_percpu(queue->stats);
+    kfree(queue->shards);
 }
 
-///**
-// * @brief   Print all messages held in the queue
-// */
-//static void print_message_queue(void) {
-//    struct message *entry;
-//
-//    list_for_each_entry(entry, &message_queue, list)
-//        printk(KERN_INFO "%s", entry->data);
-//}
-
 /**
  * @brief   Kernel module init function.
  * @return  0 on success
  */
 static int __init message_queue_init(void) {
+    unsigned int i;
+    int ret;
+
     printk(KERN_INFO "message_queue: init\n");
-    queue_not_full.done = MAX_MESSAGE_COUNT; // can write this number of messages
-    return register_message_queue_dev();
+    if (queue_count < 1 || queue_count > MAX_QUEUE_COUNT) {
+        printk(KERN_ALERT "message_queue: queue_count must be 1..%u\n", MAX_QUEUE_COUNT);
+        return -EINVAL;
+    }
+    if (msg_size < 1 || msg_size > MAX_MSG_SIZE) {
+        printk(KERN_ALERT "message_queue: msg_size must be 1..%u\n", MAX_MSG_SIZE);
+        return -EINVAL;
+    }
+    if (priorities < 1 || priorities > MQ_MAX_PRIORITIES) {
+        printk(KERN_ALERT "message_queue: priorities must be 1..%u\n", MQ_MAX_PRIORITIES);
+        return -EINVAL;
+    }
+    slot_size = mq_ring_slot_size(msg_size);
+    if (!ring_capacity(default_capacity, 1)) {
+        printk(KERN_ALERT "message_queue: capacity must be at least 1 and fit %u bytes of ring\n", MAX_RING_SIZE);
+        return -EINVAL;
+    }
+
+    queues = kcalloc(queue_count, sizeof(*queues), GFP_KERNEL);
+    if (!queues)
+        return -ENOMEM;
+
+    for (i = 0; i < queue_count; i++) {
+        if (broadcast[i] && sharded[i]) {
+            printk(KERN_ALERT "message_queue: queue %u can't be both broadcast and sharded\n", i);
+            ret = -EINVAL;
+            goto fail;
+        }
+        ret = init_message_queue(&queues[i], broadcast[i], sharded[i]);
+        if (ret) {
+            printk(KERN_ALERT "message_queue: queue %u init failed: %d\n", i, ret);
+            goto fail;
+        }
+    }
+
+    ret = register_message_queue_dev();
+    if (ret)
+        goto fail;
+    return 0;
+
+fail:
+    while (i--)
+        clean_message_queue(&queues[i]);
+    kfree(queues);
+    return ret;
 }
 
 /**
  * @brief   Kernel module exit function
  */
 static void __exit message_queue_exit(void) {
-    clean_message_queue();
+    unsigned int i;
+
     unregister_message_queue_dev();
+    for (i = 0; i < queue_count; i++)
+        clean_message_queue(&queues[i]);
+    kfree(queues);
     printk(KERN_INFO "message_queue: exit\n");
 }
 
 /**
- * @brief   User opens /dev/message_queue
+ * @brief   User opens /dev/message_queue<N>; the file is bound to queue N
  * @return  0 on success
  */
 static int dev_open(struct inode *inodep, struct file *filep) {
+    unsigned int minor = iminor(inodep);
+    struct message_queue_file *file;
+
+    if (minor >= queue_count)
+        return -ENODEV;
+
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if (!file)
+        return -ENOMEM;
+
+    file->queue = &queues[minor];
+    mutex_init(&file->lock);
+    if (file->queue->broadcast)
+        file->cursor = smp_load_acquire(&broadcast_ring(file->queue)->tail); // subscriber gets messages from now on
+    filep->private_data = file;
     return 0;
 }
 
 /**
- * @brief   User reads single message from the queue
+ * @brief   Keep the ring from resize for read/write, repairing it first if it was mapped
+ * @return  0 with resize_sem held for reading, -EBUSY if mapped
+ */
+static int lock_ring(struct message_queue *queue) {
+    for (;;) {
+        if (atomic_read(&queue->mapped))
+            return -EBUSY;
+        check_message_queue(queue);
+
+        percpu_down_read(&queue->resize_sem);
+        if (!READ_ONCE(queue->ring_dirty))
+            return 0;
+        percpu_up_read(&queue->resize_sem); // got mapped meanwhile
+    }
+}
+
+/**
+ * @brief   Block till there is some message on the queue, then keep the ring from resize.
+ *          Nonblocking fails with -EAGAIN instead
+ * @return  0 with resize_sem held for reading, error otherwise
+ */
+static int lock_readable(struct message_queue *queue, bool nonblock) {
+    u64 start;
+    int ret;
+
+    if (!message_queue_readable(queue)) {
+        if (nonblock)
+            return -EAGAIN;
+        this_cpu_inc(queue->stats->blocked_readers);
+        start = ktime_get_ns();
+        ret = wait_event_interruptible(queue->queue_not_empty, message_queue_readable(queue));
+        this_cpu_add(queue->stats->read_wait_ns, ktime_get_ns() - start);
+        if (ret)
+            return -ERESTARTSYS;
+    }
+    return lock_ring(queue);
+}
+
+/**
+ * @brief   Block till there is some space on the queue for the priority, then keep the ring from resize.
+ *          Nonblocking fails with -EAGAIN instead
+ * @return  0 with resize_sem held for reading, error otherwise
+ */
+static int lock_writable(struct message_queue *queue, u32 priority, bool nonblock) {
+    u64 start;
+    int ret;
+
+    if (!message_queue_writable(queue, priority)) {
+        if (nonblock)
+            return -EAGAIN;
+        this_cpu_inc(queue->stats->blocked_writers);
+        start = ktime_get_ns();
+        ret = wait_event_interruptible(queue->queue_not_full, message_queue_writable(queue, priority));
+        this_cpu_add(queue->stats->write_wait_ns, ktime_get_ns() - start);
+        if (ret)
+            return -ERESTARTSYS;
+    }
+    return lock_ring(queue);
+}
+
+/**
+ * @brief   Wake the sleepers of wait queue, if any; saves taking the wait queue lock on every message
+ */
+static void wake_sleepers(wait_queue_head_t *wait) {
+    if (wq_has_sleeper(wait))
+        wake_up_interruptible(wait);
+}
+
+/**
+ * @brief   Find the ring of the highest priority of the shard that has messages. A level found empty has its
+ *          levels_ready bit cleared, unless a writer published meanwhile: writers set the bit after publishing, with
+ *          full barriers on both sides one of us sees the other
+ * @return  Ring, NULL if all are empty
+ */
+static struct mq_ring *ready_level(struct message_queue *queue, struct mq_ring *ring, u32 shard) {
+    unsigned long *levels_ready = &queue->shards[shard].levels_ready;
+    u32 mask = queue->capacity - 1;
+    unsigned long ready;
+    struct mq_ring *level;
+    u32 i;
+
+    while ((ready = READ_ONCE(*levels_ready))) {
+        i = __fls(ready);
+        level = shard_ring(queue, ring, shard, i);
+        if (mq_ring_readable(level, mask, slot_size))
+            return level;
+
+        clear_bit(i, levels_ready);
+        smp_mb__after_atomic();
+        if (mq_ring_readable(level, mask, slot_size))
+            set_bit(i, levels_ready);
+    }
+    return NULL;
+}
+
+/**
+ * @brief   Move the oldest message of the highest priority to the user buffer. The message is copied out before it is
+ *          taken off the ring, so a failed copy leaves it queued, and a copy of message another reader took first is
+ *          dropped. Sharded queues are read from the local shard first, then the others are stolen from in cpu
+ *          order, so priority and FIFO order only hold within a shard. Called with resize_sem held
+ * @return  Bytes of the user buffer filled, -EAGAIN if the queue is empty, negative error otherwise
+ */
+static ssize_t get_message(struct message_queue_file *file, struct iov_iter *to) {
+    struct message_queue *queue = file->queue;
+    struct mq_ring *ring;
+    u32 mask = queue->capacity - 1;
+    size_t header = file->framed ? MQ_FRAME_HEADER_SIZE : 0;
+    struct mq_slot *entry;
+    size_t copied;
+    u32 pos, size, len, local, shard, i;
+    int state;
+
+    for (;;) {
+        if (READ_ONCE(queue->ring_dirty))
+            return -EBUSY; // ring got mapped meanwhile, user space owns it now
+
+        ring = NULL;
+        shard = local = local_shard(queue);
+        for (i = 0; i < queue->shard_count && !ring; i++) {
+            ring = ready_level(queue, locked_ring(queue), shard);
+            if (!ring && ++shard == queue->shard_count)
+                shard = 0;
+        }
+        if (!ring)
+            return -EAGAIN;
+        state = mq_ring_peek(ring, mask, slot_size, &pos);
+        if (state == MQ_RING_EMPTY)
+            continue; // other reader took the last one
+        if (state == MQ_RING_AGAIN) {
+            cpu_relax();
+            continue;
+        }
+
+        entry = mq_ring_slot(ring, pos, mask, slot_size);
+        size = READ_ONCE(entry->len);
+        if (size == MQ_SLOT_SKIP) {
+            // writer failed to fill the slot; drop it
+            if (mq_ring_take(ring, pos))
+                mq_ring_release(entry, pos, mask);
+            continue;
+        }
+        len = size = min_t(u32, size, msg_size);
+
+        if (file->framed && iov_iter_count(to) < header + len)
+            return -EMSGSIZE;
+        if (!file->framed)
+            len = min_t(size_t, len, iov_iter_count(to));
+
+        // write message data to the userspace buffer
+        copied = header ? copy_to_iter(&len, header, to) : 0;
+        if (copied == header)
+            copied += copy_to_iter(entry->data, len, to);
+        if (copied != header + len) {
+            iov_iter_revert(to, copied);
+            return -EFAULT; // message stays on the queue
+        }
+
+        if (!mq_ring_take(ring, pos)) {
+            iov_iter_revert(to, copied); // other reader was first
+            continue;
+        }
+        mq_ring_release(entry, pos, mask);
+        atomic_long_sub(size, &queue->shards[shard].bytes);
+        atomic_dec(&queue->shards[shard].messages);
+        if (shard != local)
+            this_cpu_inc(queue->stats->steals);
+        this_cpu_inc(queue->stats->dequeues);
+        this_cpu_add(queue->stats->dequeued_bytes, size);
+        return copied;
+    }
+}
+
+/**
+ * @brief   Length of next message in the user buffer: from its framed record header, or all the buffer up to msg_size
+ * @return  Bytes of header taken from the buffer, -ENODATA if the buffer ends inside the record, negative error otherwise
  */
-static ssize_t dev_read(struct file *filep, char *buffer, size_t len, loff_t *offset) {
-    struct message *entry;
-    size_t datasize;
-    int characters_left = 0;
+static ssize_t message_length(struct message_queue_file *file, struct iov_iter *from, u32 *len) {
+    if (!file->framed) {
+        *len = min_t(size_t, iov_iter_count(from), msg_size); // enforce message size limit
+        return 0;
+    }
+
+    if (iov_iter_count(from) < MQ_FRAME_HEADER_SIZE)
+        return -ENODATA;
+    if (!copy_from_iter_full(len, MQ_FRAME_HEADER_SIZE, from))
+        return -EFAULT;
+    if (*len > msg_size || iov_iter_count(from) < *len) {
+        iov_iter_revert(from, MQ_FRAME_HEADER_SIZE);
+        return *len > msg_size ? -EMSGSIZE : -ENODATA;
+    }
+    return MQ_FRAME_HEADER_SIZE;
+}
+
+/**
+ * @brief   Result of a write that took no message. A write ending inside a record took the whole records before it;
+ *          one with no whole record is malformed, unless it comes from splice, which hands over whatever the pipe
+ *          holds so far: the rest of the record may still come, so the caller should try again
+ */
+static ssize_t write_error(struct iov_iter *from, ssize_t ret) {
+    if (ret == -ENODATA)
+        return iov_iter_is_bvec(from) ? -EAGAIN : -EINVAL;
+    return ret;
+}
+
+/**
+ * @brief   Move next message from the user buffer to a free slot of the file priority. The slot is claimed before
+ *          the copy, so a failed copy publishes it marked MQ_SLOT_SKIP for readers to drop. Sharded queues take it
+ *          in the local shard, or the next one with space if that is full or over its share of max_bytes, so only a
+ *          full local shard makes the writer look at other cpus' memory. Called with resize_sem held
+ * @return  Bytes of the user buffer taken, -EAGAIN if the queue is full, negative error otherwise
+ */
+static ssize_t put_message(struct message_queue_file *file, struct iov_iter *from) {
+    struct message_queue *queue = file->queue;
+    u32 shard = local_shard(queue), tried = 0;
+    struct mq_ring *ring = shard_ring(queue, locked_ring(queue), shard, file->priority);
+    u32 mask = queue->capacity - 1;
+    unsigned long *levels_ready;
+    struct mq_slot *msg;
+    ssize_t header;
+    u32 pos, len, count;
+    int state;
+
+    header = message_length(file, from, &len);
+    if (header < 0)
+        return header;
+
+    // claim the free slot at tail, racing other writers
+    do {
+        if (READ_ONCE(queue->ring_dirty))
+            state = -EBUSY; // ring got mapped meanwhile, user space owns it now
+        else if (!shard_under_limit(queue, shard))
+            state = MQ_RING_FULL;
+        else
+            state = mq_ring_try_claim(ring, mask, slot_size, &pos);
+        if (state == MQ_RING_FULL && ++tried < queue->shard_count) {
+            if (++shard == queue->shard_count)
+                shard = 0;
+            ring = shard_ring(queue, locked_ring(queue), shard, file->priority);
+            state = MQ_RING_AGAIN;
+        }
+        if (state == MQ_RING_FULL)
+            state = -EAGAIN;
+        if (state < 0) {
+            iov_iter_revert(from, header);
+            return state;
+        }
+    } while (state == MQ_RING_AGAIN);
+    msg = mq_ring_slot(ring, pos, mask, slot_size);
+
+    // fill message data from buffer
+    if (!copy_from_iter_full(msg->data, len, from)) {
+        msg->len = MQ_SLOT_SKIP;
+        iov_iter_revert(from, header);
+        header = -EFAULT;
+    } else
+        msg->len = len;
+    mq_ring_publish(msg, pos);
+
+    // let readers find the level, a skipped slot too: it counts as readable, so a reader has to reach it to drop it.
+    // The bit is mostly set already, so only test it
+    levels_ready = &queue->shards[shard].levels_ready;
+    smp_mb();
+    if (!test_bit(file->priority, levels_ready))
+        set_bit(file->priority, levels_ready);
+    if (header < 0)
+        return header;
+
+    atomic_long_add(len, &queue->shards[shard].bytes);
+    this_cpu_inc(queue->stats->enqueues);
+    this_cpu_add(queue->stats->enqueued_bytes, len);
+    // the shard count is the one the put changes anyway, so the high water costs no scan of the rings
+    count = atomic_inc_return(&queue->shards[shard].messages);
+    if (count > READ_ONCE(queue->shards[shard].high_water))
+        WRITE_ONCE(queue->shards[shard].high_water, count); // racing writers may leave it a little low
+    return header + len;
+}
+
+/**
+ * @brief   Subscriber has messages to read on the broadcast queue
+ */
+static bool broadcast_readable(struct message_queue_file *file) {
+    return smp_load_acquire(&broadcast_ring(file->queue)->tail) != READ_ONCE(file->cursor);
+}
+
+/**
+ * @brief   Copy the message at the subscriber cursor to the user buffer. Nothing stops writers from overwriting it
+ *          meanwhile: writers mark the slot before changing it, so a changed slot sequence number after the copy
+ *          tells the copy may be torn, and the message is counted as dropped. Called under the file lock
+ * @return  Bytes of the user buffer filled, -EAGAIN if the subscriber has read all messages, negative error otherwise
+ */
+static ssize_t get_broadcast(struct message_queue_file *file, struct iov_iter *to) {
+    struct message_queue *queue = file->queue;
+    struct mq_ring *ring = broadcast_ring(queue);
+    u32 mask = queue->capacity - 1;
+    size_t header = file->framed ? MQ_FRAME_HEADER_SIZE : 0;
+    struct mq_slot *entry;
+    size_t copied;
+    u32 tail, len;
+
+    for (;;) {
+        tail = smp_load_acquire(&ring->tail);
+        if (file->cursor == tail)
+            return -EAGAIN;
+        if (tail - file->cursor > queue->capacity) {
+            // subscriber fell behind by more than the ring holds
+            file->dropped += tail - queue->capacity - file->cursor;
+            file->cursor = tail - queue->capacity;
+        }
 
+        entry = mq_ring_slot(ring, file->cursor, mask, slot_size);
+        if (smp_load_acquire(&entry->seq) != file->cursor + 1) {
+            file->dropped++; // being overwritten right now
+            file->cursor++;
+            continue;
+        }
+        len = READ_ONCE(entry->len);
+        if (len == MQ_SLOT_SKIP) {
+            file->cursor++;
+            continue;
+        }
+        len = min_t(u32, len, msg_size);
+
+        if (file->framed && iov_iter_count(to) < header + len)
+            return -EMSGSIZE;
+        if (!file->framed)
+            len = min_t(size_t, len, iov_iter_count(to));
+
+        // write message data to the userspace buffer
+        copied = header ? copy_to_iter(&len, header, to) : 0;
+        if (copied == header)
+            copied += copy_to_iter(entry->data, len, to);
+
+        smp_rmb(); // the copy is done before the recheck
+        if (READ_ONCE(entry->seq) != file->cursor + 1) {
+            iov_iter_revert(to, copied);
+            file->dropped++;
+            file->cursor++;
+            continue;
+        }
+        if (copied != header + len) {
+            iov_iter_revert(to, copied);
+            return -EFAULT; // message stays for the subscriber
+        }
+        file->cursor++;
+        this_cpu_inc(queue->stats->dequeues);
+        this_cpu_add(queue->stats->dequeued_bytes, len);
+        return copied;
+    }
+}
+
+/**
+ * @brief   Publish next message from the user buffer on the broadcast queue, overwriting the oldest one.
+ *          Called under the queue broadcast_mutex
+ * @return  Bytes of the user buffer taken, negative error otherwise
+ */
+static ssize_t put_broadcast(struct message_queue_file *file, struct iov_iter *from) {
+    struct message_queue *queue = file->queue;
+    struct mq_ring *ring = broadcast_ring(queue);
+    u32 pos = ring->tail;
+    struct mq_slot *msg = mq_ring_slot(ring, pos, queue->capacity - 1, slot_size);
+    ssize_t header;
+    u32 len;
+
+    header = message_length(file, from, &len);
+    if (header < 0)
+        return header;
+
+    // readers at the old message of the slot see it is going away
+    WRITE_ONCE(msg->seq, pos - queue->capacity);
+    smp_wmb();
+
+    // fill message data from buffer
+    if (!copy_from_iter_full(msg->data, len, from)) {
+        msg->len = MQ_SLOT_SKIP;
+        iov_iter_revert(from, header);
+        header = -EFAULT;
+    } else
+        msg->len = len;
+
+    mq_ring_publish(msg, pos);
+    smp_store_release(&ring->tail, pos + 1);
+    if (header < 0)
+        return header;
+
+    this_cpu_inc(queue->stats->enqueues);
+    this_cpu_add(queue->stats->enqueued_bytes, len);
+    return header + len;
+}
+
+/**
+ * @brief   Subscriber reads its next message from the broadcast queue, or in framed mode as many as fit the buffer
+ */
+static ssize_t broadcast_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    struct message_queue_file *file = iocb->ki_filp->private_data;
+    struct message_queue *queue = file->queue;
+    bool nonblock = iocb->ki_filp->f_flags & O_NONBLOCK;
+    size_t done = 0;
+    ssize_t ret;
+    u64 start;
 
     // if read is done, return 0 (meaning end of message data)
-    if (read_done) {
-        read_done = false; // prepare for next message read
+    if (file->read_done) {
+        file->read_done = false; // prepare for next message read
         return 0;
     }
 
-    // block till there is some message on the queue
-    if (wait_for_completion_interruptible(&queue_not_empty) == -ERESTARTSYS)
+    if (mutex_lock_interruptible(&file->lock))
         return -ERESTARTSYS;
+    for (;;) {
+        do {
+            ret = get_broadcast(file, to);
+            if (ret < 0)
+                break;
+            done += ret;
+        } while (file->framed);
 
-    mutex_lock(&message_queue_mutex);
+        if (done || ret != -EAGAIN || nonblock)
+            break;
+        this_cpu_inc(queue->stats->blocked_readers);
+        start = ktime_get_ns();
+        ret = wait_event_interruptible(queue->queue_not_empty, broadcast_readable(file));
+        this_cpu_add(queue->stats->read_wait_ns, ktime_get_ns() - start);
+        if (ret)
+            break;
+    }
+    mutex_unlock(&file->lock);
 
-    entry = list_first_entry(&message_queue, struct message, list);
-    datasize = strlen(entry->data);
+    if (!done && ret < 0)
+        return ret;
+    file->read_done = !file->framed;
+    return done;
+}
 
-    // write message data to the userspace buffer
-    characters_left = copy_to_user(buffer, entry->data, datasize);
+/**
+ * @brief   User publishes single message on the broadcast queue, or in framed mode any number of records.
+ *          Never waits for subscribers
+ */
+static ssize_t broadcast_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    struct message_queue_file *file = iocb->ki_filp->private_data;
+    struct message_queue *queue = file->queue;
+    size_t done = 0;
+    ssize_t ret;
 
-    list_del(&entry->list);
-    kfree(entry);
-    read_done = true;
-    message_count--;
-    printk(KERN_INFO "message_queue: messages left: %u\n", (unsigned)message_count);
-    complete(&queue_not_full);
-    mutex_unlock(&message_queue_mutex);
+    if (file->framed && !iov_iter_count(from))
+        return 0;
 
-    return datasize;
+    if (mutex_lock_interruptible(&queue->broadcast_mutex))
+        return -ERESTARTSYS;
+    do {
+        ret = put_broadcast(file, from);
+        if (ret < 0)
+            break;
+        done += ret;
+    } while (file->framed && iov_iter_count(from));
+    mutex_unlock(&queue->broadcast_mutex);
+
+    wake_sleepers(&queue->queue_not_empty);
+    return (done || ret >= 0) ? done : write_error(from, ret);
 }
 
 /**
- * @brief   User writes single message to the queue
+ * @brief   User reads single message from the queue, or in framed mode as many whole records as fit the buffer
  */
-static ssize_t dev_write(struct file *filep, const char *buffer, size_t len, loff_t *offset) {
-    struct message *msg;
+static ssize_t dev_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    struct message_queue_file *file = iocb->ki_filp->private_data;
+    struct message_queue *queue = file->queue;
+    bool nonblock = iocb->ki_filp->f_flags & O_NONBLOCK;
+    size_t done = 0;
+    ssize_t ret;
 
-    // block till there is some space on the queue
-    if (wait_for_completion_interruptible(&queue_not_full) == -ERESTARTSYS)
-        return -ERESTARTSYS;
+    if (queue->broadcast)
+        return broadcast_read_iter(iocb, to);
 
-    // alloc new message from kernel memory
-    msg = kmalloc(sizeof(struct message), GFP_KERNEL);
-    if (!msg) {
-        printk(KERN_ERR "message_queue: kmalloc failed\n");
-        return -ENOMEM;
+    // if read is done, return 0 (meaning end of message data)
+    if (file->read_done) {
+        file->read_done = false; // prepare for next message read
+        return 0;
     }
 
-    // enforce message size limit
-    len = min(len, sizeof(msg->data) -1); // -1 for \0
+    for (;;) {
+        ret = lock_readable(queue, nonblock);
+        if (ret)
+            return ret;
 
-    // fill message data from buffer
-    strncpy(msg->data, buffer, len);
+        do {
+            ret = get_message(file, to);
+            if (ret < 0)
+                break;
+            done += ret;
+        } while (file->framed);
 
-    // ensure message is null terminated
-    msg->data[len] = '\0';
+        percpu_up_read(&queue->resize_sem);
+        if (done || ret != -EAGAIN || nonblock)
+            break;
+        // other readers took the messages first, wait for more
+    }
 
-    mutex_lock(&message_queue_mutex);
-    list_add_tail(&msg->list, &message_queue); // put message on the list
-    message_count++;
-    complete(&queue_not_empty);
-    mutex_unlock(&message_queue_mutex);
+    if (!done && ret < 0)
+        return ret;
+    file->read_done = !file->framed;
+    wake_sleepers(&queue->queue_not_full);
+    return done;
+}
 
-    printk(KERN_INFO "message_queue: messages available: %u\n", (unsigned)message_count);
+/**
+ * @brief   User writes single message to the queue, or in framed mode any number of records
+ */
+static ssize_t dev_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    struct message_queue_file *file = iocb->ki_filp->private_data;
+    struct message_queue *queue = file->queue;
+    bool nonblock = iocb->ki_filp->f_flags & O_NONBLOCK;
+    size_t done = 0;
+    ssize_t ret;
 
-    return len;
+    if (queue->broadcast)
+        return broadcast_write_iter(iocb, from);
+    if (file->framed && !iov_iter_count(from))
+        return 0;
+
+    do {
+        // nonblocking write of a batch returns what fit so far rather than wait for space
+        ret = lock_writable(queue, file->priority, nonblock);
+        if (ret)
+            break;
+
+        // put as many records as the local shard has space for, the next round tries the other shards or blocks
+        do {
+            ret = put_message(file, from);
+            if (ret < 0)
+                break;
+            done += ret;
+        } while (file->framed && iov_iter_count(from) && shard_has_space(queue, local_shard(queue), file->priority));
+
+        percpu_up_read(&queue->resize_sem);
+        wake_sleepers(&queue->queue_not_empty);
+    } while (ret >= 0 ? file->framed && iov_iter_count(from) : ret == -EAGAIN && !nonblock);
+
+    return (done || ret >= 0) ? done : write_error(from, ret);
+}
+
+/**
+ * @brief   Pipe writes to the queue through write_iter. A framed record is only taken whole, so the largest record
+ *          (header and msg_size bytes) has to fit the pipe; a smaller pipe is refused up front, as it could leave a
+ *          record that never completes. Grow it with fcntl(F_SETPIPE_SZ)
+ */
+static ssize_t dev_splice_write(struct pipe_inode_info *pipe, struct file *filep, loff_t *ppos, size_t len,
+                                unsigned int flags) {
+    struct message_queue_file *file = filep->private_data;
+
+    if (file->framed && MQ_FRAME_HEADER_SIZE + msg_size > (size_t)pipe->max_usage * PAGE_SIZE)
+        return -EMSGSIZE;
+    return iter_file_splice_write(pipe, filep, ppos, len, flags);
+}
+
+/**
+ * @brief   User polls the queue, e.g. with epoll serving many queues from a single thread.
+ *          Readiness follows the ring, so mmap users can poll too, after raising their waiting count
+ */
+static unsigned int dev_poll(struct file *filep, poll_table *wait) {
+    struct message_queue_file *file = filep->private_data;
+    struct message_queue *queue = file->queue;
+    unsigned int mask = 0;
+
+    poll_wait(filep, &queue->queue_not_empty, wait);
+    if (queue->broadcast)
+        return (broadcast_readable(file) || file->read_done ? POLLIN | POLLRDNORM : 0) | POLLOUT | POLLWRNORM;
+    poll_wait(filep, &queue->queue_not_full, wait);
+
+    if (message_ready(queue) || file->read_done)
+        mask |= POLLIN | POLLRDNORM;
+    if (message_queue_has_space(queue, file->priority))
+        mask |= POLLOUT | POLLWRNORM;
+    return mask;
+}
+
+/**
+ * @brief   User controls the queue: gets ring size to mmap, sleeps till ring is readable/writable, wakes the other side,
+ *          switches the file to framed read/write, resizes the queue, sets priority of messages the file writes
+ * @return  0 on success
+ */
+static long dev_ioctl(struct file *filep, unsigned int cmd, unsigned long arg) {
+    struct message_queue_file *file = filep->private_data;
+    struct message_queue *queue = file->queue;
+
+    switch (cmd) {
+    case MQ_IOC_RING_SIZE:
+        return put_user((u32)queue->ring_size, (u32 __user *)arg);
+
+    case MQ_IOC_WAIT_READABLE:
+        return wait_event_interruptible(queue->queue_not_empty, message_ready(queue));
+
+    case MQ_IOC_WAIT_WRITABLE:
+        if (arg >= priorities)
+            return -EINVAL;
+        return wait_event_interruptible(queue->queue_not_full, slot_free(queue, arg));
+
+    case MQ_IOC_RESIZE:
+        if (queue->broadcast)
+            return -EOPNOTSUPP;
+        return resize_message_queue(queue, arg);
+
+    case MQ_IOC_NOTIFY:
+        wake_up_interruptible(&queue->queue_not_empty);
+        wake_up_interruptible(&queue->queue_not_full);
+        return 0;
+
+    case MQ_IOC_FRAMED:
+        file->framed = arg != 0;
+        file->read_done = false;
+        return 0;
+
+    case MQ_IOC_PRIORITY:
+        if (arg >= priorities)
+            return -EINVAL;
+        file->priority = arg;
+        return 0;
+
+    case MQ_IOC_DROPPED:
+        return put_user(file->dropped, (u64 __user *)arg);
+
+    default:
+        return -ENOTTY;
+    }
+}
+
+/**
+ * @brief   Mapping of the ring is copied (fork) or split
+ */
+static void mq_vm_open(struct vm_area_struct *vma) {
+    struct message_queue *queue = vma->vm_private_data;
+
+    atomic_inc(&queue->mapped);
+}
+
+/**
+ * @brief   Mapping of the ring is gone; with the last one read/write work again
+ */
+static void mq_vm_close(struct vm_area_struct *vma) {
+    struct message_queue *queue = vma->vm_private_data;
+
+    atomic_dec(&queue->mapped);
+}
+
+static const struct vm_operations_struct mq_vm_ops = {
+        .open = mq_vm_open,
+        .close = mq_vm_close,
+};
+
+/**
+ * @brief   User maps the queue ring, to pass messages through shared memory instead of read/write
+ * @return  0 on success
+ */
+static int dev_mmap(struct file *filep, struct vm_area_struct *vma) {
+    struct message_queue_file *file = filep->private_data;
+    struct message_queue *queue = file->queue;
+    struct mq_ring *ring;
+    int ret;
+
+    if (vma->vm_pgoff || queue->broadcast || queue->shard_count > 1)
+        return -EINVAL; // user space rings have one shard
+
+    // once mapped is raised, resize keeps the ring
+    spin_lock(&queue->ring_lock);
+    atomic_inc(&queue->mapped);
+    queue->map_generation++;
+    queue->ring_dirty = true;
+    ring = rcu_dereference_protected(queue->ring, lockdep_is_held(&queue->ring_lock));
+    spin_unlock(&queue->ring_lock);
+
+    // fails if the mapping is larger than the ring
+    ret = remap_vmalloc_range(vma, ring, 0);
+    if (ret) {
+        atomic_dec(&queue->mapped);
+        return ret;
+    }
+
+    vma->vm_ops = &mq_vm_ops;
+    vma->vm_private_data = queue;
+
+    // readers/writers blocked in read/write now fail with -EBUSY
+    wake_up_interruptible(&queue->queue_not_empty);
+    wake_up_interruptible(&queue->queue_not_full);
+    return 0;
 }
 
 /**
- * @brief   User closes /dev/message_queue
+ * @brief   User closes /dev/message_queue<N>
  * @return  0 on success
  */
 static int dev_release(struct inode *inodep, struct file *filep) {
+    kfree(filep->private_data);
     return 0;
 }
 
@@ -0,0 +1,231 @@
+/**
+ * mq_bench.c
+ *
+ *  Producer/consumer benchmark of /dev/message_queue<N>. Producers and consumers are threads spread round robin over
+ *  the queues; every message carries its send time, so consumers measure end to end latency. Prints messages/s, MB/s
+ *  and latency percentiles, to compare queue implementations and catch regressions in the module hot path.
+ *
+ *  usage: mq_bench [-p producers] [-c consumers] [-q queues] [-s message size] [-n messages per producer]
+ *                  [-b records per read/write] [-m] [/dev/message_queue]
+ */
+
+#include "mq_harness.h"
+
+#define MAX_THREADS 256
+
+static const char *prefix = "/dev/message_queue";
+static unsigned int producers = 1, consumers = 1, queue_count = 1;
+static unsigned int size = 64;          // message size
+static unsigned long count = 100000;    // messages per producer
+static unsigned int batch = 1;          // framed records per read/write
+static int use_mmap;
+
+static struct mq_queue queues[MAX_THREADS];
+
+// per consumer: latency of every message received; a cache line each, as main polls received
+struct consumer {
+    unsigned int queue;
+    __u64 *latencies;
+    unsigned long received;
+    unsigned long allocated;
+} __attribute__((aligned(64)));
+
+static struct consumer consumer_state[MAX_THREADS];
+
+static void *producer(void *arg) {
+    unsigned int id = (unsigned long)arg, messages, i;
+    struct mq_queue *queue = &queues[id % queue_count];
+    int fd = mq_queue_open(queue);
+    char *buffer = mq_alloc_records(queue, batch);
+    unsigned long seq = 0;
+
+    while (seq < count) {
+        messages = count - seq < batch ? count - seq : batch;
+        for (i = 0; i < messages; i++) {
+            mq_message(queue, buffer, i)->producer = id;
+            mq_message(queue, buffer, i)->seq = seq++;
+            mq_message(queue, buffer, i)->sent_ns = mq_now_ns();
+        }
+        mq_send(queue, fd, buffer, messages);
+    }
+
+    free(buffer);
+    mq_queue_close(fd);
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    struct consumer *state = arg;
+    struct mq_queue *queue = &queues[state->queue];
+    int fd = mq_queue_open(queue);
+    char *buffer = mq_alloc_records(queue, batch);
+    unsigned int messages, stops, i;
+    __u64 now;
+
+    for (stops = 0; !stops;) {
+        messages = mq_receive(queue, fd, buffer, batch);
+        now = mq_now_ns();
+
+        for (i = 0; i < messages; i++) {
+            if (mq_message(queue, buffer, i)->producer == MQ_STOP) {
+                stops++;
+                continue;
+            }
+            if (state->received == state->allocated) {
+                state->allocated = state->allocated ? 2 * state->allocated : 4096;
+                state->latencies = realloc(state->latencies, state->allocated * sizeof(*state->latencies));
+                if (!state->latencies)
+                    mq_fail("realloc");
+            }
+            state->latencies[state->received] = now - mq_message(queue, buffer, i)->sent_ns;
+            __atomic_store_n(&state->received, state->received + 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    free(buffer);
+    mq_queue_close(fd);
+
+    // stops meant for other consumers of the queue go back
+    if (stops > 1)
+        mq_send_stops(queue, stops - 1);
+    return NULL;
+}
+
+static unsigned long received_count(void) {
+    unsigned long sum = 0;
+    unsigned int i;
+
+    for (i = 0; i < consumers; i++)
+        sum += __atomic_load_n(&consumer_state[i].received, __ATOMIC_RELAXED);
+    return sum;
+}
+
+/**
+ * @brief   Sum of a stats counter over the queues
+ * @return  The sum, -1 if the module has no such counter
+ */
+static long long queues_stat(const char *name) {
+    long long sum = 0, value;
+    unsigned int queue;
+
+    for (queue = 0; queue < queue_count; queue++) {
+        value = mq_queue_stat(&queues[queue], name);
+        if (value < 0)
+            return -1;
+        sum += value;
+    }
+    return sum;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    __u64 x = *(const __u64 *)a, y = *(const __u64 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief   Print throughput, latency percentiles of all the consumers and messages stolen from other cpus' shards
+ * @return  0 if every message arrived
+ */
+static int report(double seconds, long long steals) {
+    static const double percentiles[] = { 50, 90, 99, 99.9, 99.99 };
+    unsigned long total = 0, sent = producers * count, i, n = 0;
+    __u64 *all;
+
+    for (i = 0; i < consumers; i++)
+        total += consumer_state[i].received;
+    all = malloc((total ? total : 1) * sizeof(*all));
+    if (!all)
+        mq_fail("malloc");
+    for (i = 0; i < consumers; i++) {
+        memcpy(all + n, consumer_state[i].latencies, consumer_state[i].received * sizeof(*all));
+        n += consumer_state[i].received;
+    }
+    qsort(all, total, sizeof(*all), compare_u64);
+
+    printf("%u producers, %u consumers, %u queues, %u byte messages, batch %u, %s\n", producers, consumers, queue_count,
+           size, batch, use_mmap ? "mmap" : "read/write");
+    printf("%lu messages in %.3f s: %.0f msgs/s, %.1f MB/s\n", total, seconds, total / seconds,
+           total * (double)size / seconds / 1e6);
+    if (total) {
+        printf("latency us:");
+        for (i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+            printf(" p%g %.1f", percentiles[i], all[(unsigned long)(percentiles[i] / 100 * (total - 1))] / 1e3);
+        printf(" max %.1f\n", all[total - 1] / 1e3);
+    }
+    if (steals >= 0)
+        printf("steals: %lld (%.1f%% of the messages)\n", steals, total ? 100.0 * steals / total : 0.0);
+    free(all);
+
+    if (total != sent) {
+        fprintf(stderr, "%lu of %lu messages received\n", total, sent);
+        return -1;
+    }
+    return 0;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-p producers] [-c consumers] [-q queues] [-s message size] [-n messages per producer]\n"
+                    "          [-b records per read/write] [-m] [/dev/message_queue]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    pthread_t producer_threads[MAX_THREADS], consumer_threads[MAX_THREADS];
+    unsigned int i, queue, stops[MAX_THREADS] = { 0 };
+    char path[64];
+    long long steals;
+    double seconds;
+    __u64 start;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:c:q:s:n:b:m")) != -1) {
+        switch (opt) {
+        case 'p': producers = strtoul(optarg, NULL, 0); break;
+        case 'c': consumers = strtoul(optarg, NULL, 0); break;
+        case 'q': queue_count = strtoul(optarg, NULL, 0); break;
+        case 's': size = strtoul(optarg, NULL, 0); break;
+        case 'n': count = strtoul(optarg, NULL, 0); break;
+        case 'b': batch = strtoul(optarg, NULL, 0); break;
+        case 'm': use_mmap = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind < argc)
+        prefix = argv[optind];
+    if (queue_count < 1 || producers < queue_count || consumers < queue_count || producers > MAX_THREADS ||
+        consumers > MAX_THREADS || size < sizeof(struct mq_payload) || batch < 1 || count < 1) {
+        fprintf(stderr, "need 1 <= queues <= producers, consumers <= %u, message size >= %zu, batch >= 1\n",
+                MAX_THREADS, sizeof(struct mq_payload));
+        usage(argv[0]);
+    }
+
+    for (queue = 0; queue < queue_count; queue++) {
+        snprintf(path, sizeof(path), "%s%u", prefix, queue);
+        mq_queue_init(&queues[queue], path, size, use_mmap);
+    }
+
+    steals = queues_stat("steals");
+    start = mq_now_ns();
+    for (i = 0; i < consumers; i++) {
+        consumer_state[i].queue = i % queue_count;
+        stops[i % queue_count]++;
+        mq_thread_create(&consumer_threads[i], consumer, &consumer_state[i]);
+    }
+    for (i = 0; i < producers; i++)
+        mq_thread_create(&producer_threads[i], producer, (void *)(unsigned long)i);
+    for (i = 0; i < producers; i++)
+        pthread_join(producer_threads[i], NULL);
+
+    // a sharded queue is not FIFO, so stop the consumers only once they took all the messages
+    mq_wait_received(received_count, producers * count);
+    for (queue = 0; queue < queue_count; queue++)
+        mq_send_stops(&queues[queue], stops[queue]);
+    for (i = 0; i < consumers; i++)
+        pthread_join(consumer_threads[i], NULL);
+    seconds = (mq_now_ns() - start) / 1e9;
+
+    if (steals >= 0)
+        steals = queues_stat("steals") - steals;
+    return report(seconds, steals) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
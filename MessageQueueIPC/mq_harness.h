@@ -0,0 +1,224 @@
+/**
+ * mq_harness.h
+ *
+ *  What the test programs of /dev/message_queue<N> (mq_stress, mq_bench) share: messages that carry their producer,
+ *  sequence number and send time, moved as framed records through read/write or one by one through the mmapped
+ *  ring, plus timing and thread helpers that give up the program on any error.
+ */
+
+#ifndef MQ_HARNESS_H_
+#define MQ_HARNESS_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "mq_ring.h"
+
+#define MQ_STOP (~0u)                   // producer id of the message telling a consumer to finish
+#define MQ_STALL_NS 5000000000ull       // no message received for that long: the rest is lost
+
+// start of every message, the rest up to the message size is filler
+struct mq_payload {
+    __u32 producer;
+    __u32 seq;
+    __u64 sent_ns;
+};
+
+// queue as all threads of a program use it
+struct mq_queue {
+    char path[64];
+    unsigned int size;                  // of the messages
+    int use_mmap;
+    int ring_fd;                        // mmap mode: all threads share the fd and the ring
+    struct mq_ring *ring;
+};
+
+static inline __u64 mq_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline void mq_fail(const char *what) {
+    perror(what);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief   Set up queue at path for messages of size bytes; in mmap mode map its ring
+ */
+static inline void mq_queue_init(struct mq_queue *queue, const char *path, unsigned int size, int use_mmap) {
+    snprintf(queue->path, sizeof(queue->path), "%s", path);
+    queue->size = size;
+    queue->use_mmap = use_mmap;
+    queue->ring_fd = -1;
+    queue->ring = NULL;
+    if (!use_mmap)
+        return;
+
+    queue->ring_fd = open(path, O_RDWR);
+    if (queue->ring_fd < 0 || !(queue->ring = mq_ring_map(queue->ring_fd)))
+        mq_fail(path);
+    if (queue->ring->message_size < size) {
+        fprintf(stderr, "%s: msg_size %u below message size %u\n", path, queue->ring->message_size, size);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief   Open the queue for read/write of framed records
+ * @return  File descriptor, -1 in mmap mode where the shared ring is used
+ */
+static inline int mq_queue_open(const struct mq_queue *queue) {
+    int fd;
+
+    if (queue->use_mmap)
+        return -1;
+    fd = open(queue->path, O_RDWR);
+    if (fd < 0)
+        mq_fail(queue->path);
+    if (ioctl(fd, MQ_IOC_FRAMED, 1) < 0)
+        mq_fail("MQ_IOC_FRAMED");
+    return fd;
+}
+
+static inline void mq_queue_close(int fd) {
+    if (fd >= 0)
+        close(fd);
+}
+
+/**
+ * @brief   Size of a framed record of one message
+ */
+static inline size_t mq_record_size(const struct mq_queue *queue) {
+    return MQ_FRAME_HEADER_SIZE + queue->size;
+}
+
+static inline struct mq_payload *mq_message(const struct mq_queue *queue, char *buffer, unsigned int i) {
+    return (struct mq_payload *)(buffer + i * mq_record_size(queue) + MQ_FRAME_HEADER_SIZE);
+}
+
+/**
+ * @brief   Buffer of batch framed records of the message size
+ */
+static inline char *mq_alloc_records(const struct mq_queue *queue, unsigned int batch) {
+    char *buffer = calloc(batch, mq_record_size(queue));
+    __u32 len = queue->size;
+    unsigned int i;
+
+    if (!buffer)
+        mq_fail("calloc");
+    for (i = 0; i < batch; i++)
+        memcpy(buffer + i * mq_record_size(queue), &len, sizeof(len));
+    return buffer;
+}
+
+/**
+ * @brief   Send messages one by one through the ring, or as framed records in a single write
+ */
+static inline void mq_send(const struct mq_queue *queue, int fd, char *buffer, unsigned int messages) {
+    unsigned int i;
+    ssize_t ret;
+
+    if (queue->use_mmap) {
+        for (i = 0; i < messages; i++)
+            if (mq_ring_send(queue->ring_fd, queue->ring, mq_message(queue, buffer, i), queue->size))
+                mq_fail("mq_ring_send");
+        return;
+    }
+
+    ret = write(fd, buffer, messages * mq_record_size(queue));
+    if (ret != (ssize_t)(messages * mq_record_size(queue)))
+        mq_fail("write");
+}
+
+/**
+ * @brief   Receive up to batch messages into buffer as framed records; the ring gives one at a time
+ * @return  Number of messages received
+ */
+static inline unsigned int mq_receive(const struct mq_queue *queue, int fd, char *buffer, unsigned int batch) {
+    ssize_t ret;
+
+    if (queue->use_mmap) {
+        if (mq_ring_receive(queue->ring_fd, queue->ring, mq_message(queue, buffer, 0), queue->size) != (int)queue->size)
+            mq_fail("mq_ring_receive");
+        return 1;
+    }
+
+    ret = read(fd, buffer, batch * mq_record_size(queue));
+    if (ret <= 0 || ret % mq_record_size(queue))
+        mq_fail("read");
+    return ret / mq_record_size(queue);
+}
+
+/**
+ * @brief   Wait till the consumers received expected messages, as received() counts them. Sharded queues keep order
+ *          only within a cpu, so stop messages may only be sent once all the others are taken. Gives up when the count
+ *          stalls, so a lost message fails the check of the counts rather than hangs the program
+ */
+static inline void mq_wait_received(unsigned long (*received)(void), unsigned long expected) {
+    unsigned long count, last = 0;
+    __u64 moved = mq_now_ns();
+
+    while ((count = received()) < expected) {
+        if (count != last) {
+            last = count;
+            moved = mq_now_ns();
+        } else if (mq_now_ns() - moved > MQ_STALL_NS) {
+            fprintf(stderr, "%lu of %lu messages received, stopping the consumers\n", count, expected);
+            return;
+        }
+        usleep(100);
+    }
+}
+
+/**
+ * @brief   Counter of the queue in /sys/class/message_queue/<queue>/stats, e.g. "steals"
+ * @return  Its value, -1 if the module has no such counter
+ */
+static inline long long mq_queue_stat(const struct mq_queue *queue, const char *name) {
+    const char *device = strrchr(queue->path, '/');
+    char path[128];
+    long long value;
+    FILE *file;
+
+    snprintf(path, sizeof(path), "/sys/class/message_queue/%s/stats/%s", device ? device + 1 : queue->path, name);
+    file = fopen(path, "r");
+    if (!file)
+        return -1;
+    if (fscanf(file, "%lld", &value) != 1)
+        value = -1;
+    fclose(file);
+    return value;
+}
+
+/**
+ * @brief   Send stops messages telling consumers of the queue to finish
+ */
+static inline void mq_send_stops(const struct mq_queue *queue, unsigned int stops) {
+    int fd = mq_queue_open(queue);
+    char *buffer = mq_alloc_records(queue, 1);
+
+    mq_message(queue, buffer, 0)->producer = MQ_STOP;
+    while (stops--)
+        mq_send(queue, fd, buffer, 1);
+    free(buffer);
+    mq_queue_close(fd);
+}
+
+static inline void mq_thread_create(pthread_t *thread, void *(*start)(void *), void *arg) {
+    int ret = pthread_create(thread, NULL, start, arg);
+
+    if (ret) {
+        errno = ret;
+        mq_fail("pthread_create");
+    }
+}
+
+#endif /* MQ_HARNESS_H_ */
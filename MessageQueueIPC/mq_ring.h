@@ -0,0 +1,338 @@
+/**
+ * mq_ring.h
+ *
+ *  Message ring of a queue: bounded lock-free multi-producer multi-consumer ring (Vyukov style, every slot carries
+ *  a sequence number telling whether it is free or filled for the current lap). The module uses it for read/write,
+ *  and user space can mmap it from /dev/message_queue<N> to exchange messages in place, any number of producers
+ *  and consumers. The module is then used only to sleep when the ring is empty/full and to wake the other side.
+ *  A queue has one such ring per message priority, the highest priority non-empty ring is read first.
+ */
+
+#ifndef MQ_RING_H_
+#define MQ_RING_H_
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#ifdef __KERNEL__
+#include <asm/barrier.h>
+#define mq_load_relaxed(p)      READ_ONCE(*(p))
+#define mq_load_acquire(p)      smp_load_acquire(p)
+#define mq_store_release(p, v)  smp_store_release(p, v)
+#define mq_cmpxchg(p, o, n)     (cmpxchg(p, o, n) == (o))
+#else
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#define mq_load_relaxed(p)      __atomic_load_n(p, __ATOMIC_RELAXED)
+#define mq_load_acquire(p)      __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define mq_store_release(p, v)  __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define mq_cmpxchg(p, o, n)     mq_cmpxchg32(p, o, n)
+
+static inline int mq_cmpxchg32(__u32 *p, __u32 old, __u32 val) {
+    return __atomic_compare_exchange_n(p, &old, val, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+#endif
+
+#define MQ_RING_MAGIC   0x3472716d      // "mqr4"
+#define MQ_MESSAGE_SIZE 256             // default max message length
+#define MQ_CACHELINE    64
+#define MQ_SLOT_SKIP    0xffffffffu     // mq_slot.len of a slot claimed but never filled; consumers drop it
+#define MQ_MAX_PRIORITIES 32            // message priorities are 0 (default, lowest) .. priorities - 1
+
+// ioctls of /dev/message_queue<N>
+#define MQ_IOC_RING_SIZE        _IOR('q', 1, __u32)     // size to mmap
+#define MQ_IOC_WAIT_READABLE    _IO('q', 2)             // sleep till a level ring is not empty
+#define MQ_IOC_WAIT_WRITABLE    _IO('q', 3)             // arg: priority; sleep till its level ring is not full
+#define MQ_IOC_NOTIFY           _IO('q', 4)             // wake sides sleeping in MQ_IOC_WAIT_*
+#define MQ_IOC_FRAMED           _IO('q', 5)             // arg 1: read/write of this file carry framed messages
+#define MQ_IOC_RESIZE           _IO('q', 6)             // arg: new capacity; queued messages are kept
+#define MQ_IOC_PRIORITY         _IO('q', 7)             // arg: priority of messages written by this file
+#define MQ_IOC_DROPPED          _IOR('q', 8, __u64)     // broadcast subscriber: messages overwritten before read
+
+// framed read/write: any number of records, each a __u32 length followed by that many bytes, no padding
+#define MQ_FRAME_HEADER_SIZE    sizeof(__u32)
+
+// result of single attempt on the ring
+#define MQ_RING_OK      0
+#define MQ_RING_FULL    1               // or empty, for consumers
+#define MQ_RING_EMPTY   MQ_RING_FULL
+#define MQ_RING_AGAIN   2               // lost a race with another producer/consumer, try again
+
+// single message slot, slot_size bytes long
+struct mq_slot {
+    __u32 seq;                  // pos: free for producer of pos, pos + 1: filled for consumer of pos
+    __u32 len;
+    char data[];                // message_size bytes
+};
+
+// ring header, followed by capacity slots. head and tail are free running positions, slot is pos & (capacity - 1).
+// A queue has one ring per priority level, level_size bytes apart; waiting counts of the level 0 ring serve them all
+struct mq_ring {
+    __u32 magic;
+    __u32 capacity;             // power of 2
+    __u32 message_size;         // max message length
+    __u32 slot_size;
+    __u32 levels;               // number of priorities
+    __u32 level_size;
+    char pad0[MQ_CACHELINE - 6 * sizeof(__u32)];
+    __u32 tail;                 // position of next message to write
+    char pad1[MQ_CACHELINE - sizeof(__u32)];
+    __u32 head;                 // position of next message to read
+    char pad2[MQ_CACHELINE - sizeof(__u32)];
+    __u32 waiting_readers;      // mmap users sleeping in MQ_IOC_WAIT_READABLE
+    __u32 waiting_writers;      // mmap users sleeping in MQ_IOC_WAIT_WRITABLE
+    char pad3[MQ_CACHELINE - 2 * sizeof(__u32)];
+};
+
+/**
+ * @brief   Bytes taken by slot for messages up to message_size long
+ */
+static inline __u32 mq_ring_slot_size(__u32 message_size) {
+    return (sizeof(struct mq_slot) + message_size + 7) & ~7u;
+}
+
+/**
+ * @brief   Bytes taken by ring of given capacity
+ */
+static inline size_t mq_ring_size(__u32 capacity, __u32 slot_size) {
+    return sizeof(struct mq_ring) + (size_t)capacity * slot_size;
+}
+
+/**
+ * @brief   Slot of given position. Geometry is passed in, the module never trusts the one in the shared header
+ */
+static inline struct mq_slot *mq_ring_slot(struct mq_ring *ring, __u32 pos, __u32 mask, __u32 slot_size) {
+    return (struct mq_slot *)((char *)(ring + 1) + (size_t)(pos & mask) * slot_size);
+}
+
+/**
+ * @brief   Make ring empty: every slot free for the first lap
+ */
+static inline void mq_ring_reset(struct mq_ring *ring, __u32 mask, __u32 slot_size) {
+    __u32 pos;
+
+    ring->head = ring->tail = 0;
+    for (pos = 0; pos <= mask; pos++)
+        mq_ring_slot(ring, pos, mask, slot_size)->seq = pos;
+}
+
+/**
+ * @brief   Try to claim slot for the next message; fill it and mq_ring_publish it then
+ * @return  MQ_RING_OK with pos set, MQ_RING_FULL, MQ_RING_AGAIN
+ */
+static inline int mq_ring_try_claim(struct mq_ring *ring, __u32 mask, __u32 slot_size, __u32 *pos) {
+    __u32 tail = mq_load_relaxed(&ring->tail);
+    __s32 diff = (__s32)(mq_load_acquire(&mq_ring_slot(ring, tail, mask, slot_size)->seq) - tail);
+
+    if (diff < 0)
+        return MQ_RING_FULL;    // slot still holds message of previous lap
+    if (diff > 0 || !mq_cmpxchg(&ring->tail, tail, tail + 1))
+        return MQ_RING_AGAIN;
+    *pos = tail;
+    return MQ_RING_OK;
+}
+
+/**
+ * @brief   Hand filled slot over to consumers
+ */
+static inline void mq_ring_publish(struct mq_slot *slot, __u32 pos) {
+    mq_store_release(&slot->seq, pos + 1);
+}
+
+/**
+ * @brief   Try to find the next message, without taking it; read it then mq_ring_take it
+ * @return  MQ_RING_OK with pos set, MQ_RING_EMPTY, MQ_RING_AGAIN
+ */
+static inline int mq_ring_peek(struct mq_ring *ring, __u32 mask, __u32 slot_size, __u32 *pos) {
+    __u32 head = mq_load_relaxed(&ring->head);
+    __s32 diff = (__s32)(mq_load_acquire(&mq_ring_slot(ring, head, mask, slot_size)->seq) - (head + 1));
+
+    if (diff < 0)
+        return MQ_RING_EMPTY;   // slot not filled yet
+    if (diff > 0)
+        return MQ_RING_AGAIN;
+    *pos = head;
+    return MQ_RING_OK;
+}
+
+/**
+ * @brief   Take message found by mq_ring_peek. Whatever was read from the slot before is valid only on success
+ * @return  True on success, false if another consumer took it first
+ */
+static inline int mq_ring_take(struct mq_ring *ring, __u32 pos) {
+    return mq_cmpxchg(&ring->head, pos, pos + 1);
+}
+
+/**
+ * @brief   Give taken slot back to producers, for the next lap
+ */
+static inline void mq_ring_release(struct mq_slot *slot, __u32 pos, __u32 mask) {
+    mq_store_release(&slot->seq, pos + mask + 1);
+}
+
+/**
+ * @brief   The next message is filled
+ */
+static inline int mq_ring_readable(struct mq_ring *ring, __u32 mask, __u32 slot_size) {
+    __u32 head = mq_load_acquire(&ring->head);
+
+    return mq_load_acquire(&mq_ring_slot(ring, head, mask, slot_size)->seq) == head + 1;
+}
+
+/**
+ * @brief   The next slot is free
+ */
+static inline int mq_ring_writable(struct mq_ring *ring, __u32 mask, __u32 slot_size) {
+    __u32 tail = mq_load_acquire(&ring->tail);
+
+    return mq_load_acquire(&mq_ring_slot(ring, tail, mask, slot_size)->seq) == tail;
+}
+
+#ifndef __KERNEL__
+
+/**
+ * @brief   Map the rings of an open /dev/message_queue<N>, one per priority. Read/write on the queue fail with EBUSY
+ *          while mapped
+ * @return  Level 0 ring, or NULL with errno set
+ */
+static inline struct mq_ring *mq_ring_map(int fd) {
+    __u32 size;
+    void *ring;
+
+    if (ioctl(fd, MQ_IOC_RING_SIZE, &size) < 0)
+        return NULL;
+
+    ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    return ring == MAP_FAILED ? NULL : (struct mq_ring *)ring;
+}
+
+/**
+ * @brief   Ring of given priority; ring is the level 0 ring returned by mq_ring_map
+ */
+static inline struct mq_ring *mq_ring_level(struct mq_ring *ring, __u32 priority) {
+    return (struct mq_ring *)((char *)ring + (size_t)priority * ring->level_size);
+}
+
+/**
+ * @brief   Some level of the queue has a message
+ */
+static inline int mq_ring_user_readable(struct mq_ring *ring) {
+    __u32 level;
+
+    for (level = 0; level < ring->levels; level++)
+        if (mq_ring_readable(mq_ring_level(ring, level), ring->capacity - 1, ring->slot_size))
+            return 1;
+    return 0;
+}
+
+/**
+ * @brief   The level ring has a free slot
+ */
+static inline int mq_ring_user_writable(struct mq_ring *level) {
+    return mq_ring_writable(level, level->capacity - 1, level->slot_size);
+}
+
+/**
+ * @brief   Sleep in the module till ready(ring) holds. The waiting count is raised before the final check,
+ *          so the other side either sees it and notifies, or its update is seen here
+ * @return  0 on success, -1 with errno set
+ */
+static inline int mq_ring_wait(int fd, struct mq_ring *ring, __u32 *waiting, unsigned long request, unsigned long arg,
+                               int (*ready)(struct mq_ring *)) {
+    int ret = 0;
+
+    __atomic_fetch_add(waiting, 1, __ATOMIC_SEQ_CST);
+    while (!ready(ring) && ret == 0)
+        if (ioctl(fd, request, arg) < 0 && errno != EINTR)
+            ret = -1;
+    __atomic_fetch_sub(waiting, 1, __ATOMIC_SEQ_CST);
+    return ret;
+}
+
+/**
+ * @brief   Wake the other side if some of it sleeps in the module
+ */
+static inline void mq_ring_notify(int fd, __u32 *waiting) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_RELAXED))
+        ioctl(fd, MQ_IOC_NOTIFY);
+}
+
+/**
+ * @brief   Put message of given priority on the ring, sleep while its level is full
+ * @return  0 on success, -1 with errno set
+ */
+static inline int mq_ring_send_priority(int fd, struct mq_ring *ring, __u32 priority, const void *data, __u32 len) {
+    __u32 mask = ring->capacity - 1, pos;
+    struct mq_ring *level;
+    struct mq_slot *slot;
+    int state;
+
+    if (len > ring->message_size || priority >= ring->levels) {
+        errno = len > ring->message_size ? EMSGSIZE : EINVAL;
+        return -1;
+    }
+    level = mq_ring_level(ring, priority);
+
+    while ((state = mq_ring_try_claim(level, mask, ring->slot_size, &pos)) != MQ_RING_OK)
+        if (state == MQ_RING_FULL &&
+            mq_ring_wait(fd, level, &ring->waiting_writers, MQ_IOC_WAIT_WRITABLE, priority, mq_ring_user_writable))
+            return -1;
+
+    slot = mq_ring_slot(level, pos, mask, ring->slot_size);
+    slot->len = len;
+    memcpy(slot->data, data, len);
+    mq_ring_publish(slot, pos);
+    mq_ring_notify(fd, &ring->waiting_readers);
+    return 0;
+}
+
+/**
+ * @brief   Put message of default priority 0 on the ring, sleep while the ring is full
+ * @return  0 on success, -1 with errno set
+ */
+static inline int mq_ring_send(int fd, struct mq_ring *ring, const void *data, __u32 len) {
+    return mq_ring_send_priority(fd, ring, 0, data, len);
+}
+
+/**
+ * @brief   Take the oldest message of the highest priority from the ring into buffer, sleep while the ring is empty
+ * @return  Message length (truncated to size), -1 with errno set
+ */
+static inline int mq_ring_receive(int fd, struct mq_ring *ring, void *buffer, __u32 size) {
+    __u32 mask = ring->capacity - 1, pos, len;
+    struct mq_ring *level = NULL;
+    struct mq_slot *slot;
+    int priority, state;
+
+    for (;;) {
+        for (priority = ring->levels - 1; priority >= 0; priority--) {
+            level = mq_ring_level(ring, priority);
+            do
+                state = mq_ring_peek(level, mask, ring->slot_size, &pos);
+            while (state == MQ_RING_AGAIN || (state == MQ_RING_OK && !mq_ring_take(level, pos)));
+            if (state == MQ_RING_OK)
+                break;
+        }
+        if (priority < 0) {
+            if (mq_ring_wait(fd, ring, &ring->waiting_readers, MQ_IOC_WAIT_READABLE, 0, mq_ring_user_readable))
+                return -1;
+            continue;
+        }
+
+        slot = mq_ring_slot(level, pos, mask, ring->slot_size);
+        len = slot->len;
+        if (len != MQ_SLOT_SKIP)
+            memcpy(buffer, slot->data, len < size ? len : size);
+        mq_ring_release(slot, pos, mask);
+        mq_ring_notify(fd, &ring->waiting_writers);
+        if (len != MQ_SLOT_SKIP)
+            return len < size ? len : size;
+    }
+}
+
+#endif // __KERNEL__
+
+#endif /* MQ_RING_H_ */
@@ -0,0 +1,237 @@
+/**
+ * mq_stress.c
+ *
+ *  Stress test of a /dev/message_queue<N>: 1, 2, 4 .. 32 producer/consumer thread pairs pass messages through the
+ *  same queue, with read/write or (-m) through the mmapped ring. Checks every message arrived once and prints
+ *  messages/s for each number of pairs, to see how the queue scales with contention, and how many messages readers
+ *  of a sharded queue stole from other cpus. Given several queues, e.g. a sharded one and a plain one, runs every
+ *  number of pairs on each of them in turn, so their numbers print side by side. With -f instead checks that a write
+ *  faulting on its buffer leaves each queue usable: a blocked reader neither spins nor misses the next message.
+ *
+ *  usage: mq_stress [-m | -f] [-n messages per producer] [-p max pairs] [/dev/message_queue0 ...]
+ */
+
+#include "mq_harness.h"
+
+#define MAX_PAIRS 32
+#define MAX_QUEUES 8
+#define FAULT_IDLE_US 200000            // time the reader should sleep through after the faulted write
+
+static struct mq_queue queues[MAX_QUEUES];
+static struct mq_queue *queue;          // the one the threads of the current run use
+static unsigned long count = 100000;    // messages per producer
+
+// per producer: messages received and sum of their sequence numbers
+static unsigned long received[MAX_PAIRS];
+static unsigned long long seq_sum[MAX_PAIRS];
+
+static void *producer(void *arg) {
+    __u32 id = (unsigned long)arg;
+    int fd = mq_queue_open(queue);
+    char *buffer = mq_alloc_records(queue, 1);
+    __u32 seq;
+
+    for (seq = 0; seq < count; seq++) {
+        mq_message(queue, buffer, 0)->producer = id;
+        mq_message(queue, buffer, 0)->seq = seq;
+        mq_send(queue, fd, buffer, 1);
+    }
+    free(buffer);
+    mq_queue_close(fd);
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    int fd = mq_queue_open(queue);
+    char *buffer = mq_alloc_records(queue, 1);
+    struct mq_payload *message = mq_message(queue, buffer, 0);
+
+    (void)arg;
+
+    for (;;) {
+        mq_receive(queue, fd, buffer, 1);
+        if (message->producer == MQ_STOP)
+            break;
+        if (message->producer >= MAX_PAIRS) {
+            fprintf(stderr, "bad message from producer %u\n", message->producer);
+            exit(EXIT_FAILURE);
+        }
+        __atomic_fetch_add(&received[message->producer], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&seq_sum[message->producer], message->seq, __ATOMIC_RELAXED);
+    }
+    free(buffer);
+    mq_queue_close(fd);
+    return NULL;
+}
+
+static unsigned long received_count(void) {
+    unsigned long sum = 0;
+    unsigned int i;
+
+    for (i = 0; i < MAX_PAIRS; i++)
+        sum += __atomic_load_n(&received[i], __ATOMIC_RELAXED);
+    return sum;
+}
+
+/**
+ * @brief   Pass count messages from each of pairs producers to pairs consumers through the queue
+ * @return  0 if every message arrived once
+ */
+static int run(struct mq_queue *run_queue, unsigned int pairs) {
+    pthread_t producers[MAX_PAIRS], consumers[MAX_PAIRS];
+    unsigned int i;
+    long long steals;
+    __u64 start;
+    double elapsed;
+    int ret = 0;
+
+    memset(received, 0, sizeof(received));
+    memset(seq_sum, 0, sizeof(seq_sum));
+    queue = run_queue;
+    steals = mq_queue_stat(queue, "steals");
+
+    start = mq_now_ns();
+    for (i = 0; i < pairs; i++) {
+        mq_thread_create(&consumers[i], consumer, NULL);
+        mq_thread_create(&producers[i], producer, (void *)(unsigned long)i);
+    }
+    for (i = 0; i < pairs; i++)
+        pthread_join(producers[i], NULL);
+
+    // a sharded queue is not FIFO, so stop the consumers only once they took all the messages
+    mq_wait_received(received_count, pairs * count);
+    mq_send_stops(queue, pairs);
+    for (i = 0; i < pairs; i++)
+        pthread_join(consumers[i], NULL);
+    elapsed = (mq_now_ns() - start) / 1e9;
+    if (steals >= 0)
+        steals = mq_queue_stat(queue, "steals") - steals;
+
+    for (i = 0; i < pairs; i++)
+        if (received[i] != count || seq_sum[i] != (unsigned long long)count * (count - 1) / 2) {
+            fprintf(stderr, "producer %u: %lu of %lu messages received\n", i, received[i], count);
+            ret = -1;
+        }
+
+    printf("%2u pairs: %-24s %10.0f msgs/s", pairs, queue->path, pairs * count / elapsed);
+    if (steals >= 0)
+        printf(" %10lld steals", steals);
+    printf("\n");
+    return ret;
+}
+
+/**
+ * @brief   Write from an unmapped buffer while a reader blocks on the empty queue, then send a message. The failed
+ *          write leaves a claimed slot behind that the reader must drop and then go back to sleep, not spin on
+ * @return  0 if the reader stayed idle and got the message
+ */
+static int fault_check(struct mq_queue *run_queue) {
+    pthread_t reader;
+    clockid_t clock;
+    struct timespec before, after;
+    long long spent_ns;
+    void *unmapped;
+    char *buffer;
+    int fd, ret = 0;
+    ssize_t written;
+
+    memset(received, 0, sizeof(received));
+    memset(seq_sum, 0, sizeof(seq_sum));
+    queue = run_queue;
+    mq_thread_create(&reader, consumer, NULL);
+    usleep(FAULT_IDLE_US);              // let it block in read
+
+    // a plain write of one message, so the module fails copying it rather than its frame header
+    unmapped = mmap(NULL, queue->size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (unmapped == MAP_FAILED)
+        mq_fail("mmap");
+    fd = open(queue->path, O_RDWR);
+    if (fd < 0)
+        mq_fail(queue->path);
+    if (pthread_getcpuclockid(reader, &clock))
+        mq_fail("pthread_getcpuclockid");
+    clock_gettime(clock, &before);
+    written = write(fd, unmapped, queue->size);
+    if (written >= 0 || errno != EFAULT) {
+        fprintf(stderr, "%s: write from unmapped buffer returned %zd, expected EFAULT\n", queue->path, written);
+        ret = -1;
+    }
+    close(fd);
+    munmap(unmapped, queue->size);
+
+    usleep(FAULT_IDLE_US);
+    clock_gettime(clock, &after);
+    spent_ns = (after.tv_sec - before.tv_sec) * 1000000000ll + after.tv_nsec - before.tv_nsec;
+    if (spent_ns > FAULT_IDLE_US * 1000ll / 4) {
+        fprintf(stderr, "%s: blocked reader used %lld ms of cpu after the faulted write\n", queue->path,
+                spent_ns / 1000000);
+        ret = -1;
+    }
+
+    fd = mq_queue_open(queue);
+    buffer = mq_alloc_records(queue, 1);
+    mq_send(queue, fd, buffer, 1);      // producer 0, seq 0
+    free(buffer);
+    mq_queue_close(fd);
+    mq_wait_received(received_count, 1);
+    if (received_count() != 1) {
+        fprintf(stderr, "%s: reader missed the message sent after the faulted write\n", queue->path);
+        exit(EXIT_FAILURE);             // the reader still blocks, a stop message would only be taken as the lost one
+    }
+    mq_send_stops(queue, 1);
+    pthread_join(reader, NULL);
+
+    printf("fault: %-24s %s\n", queue->path, ret ? "FAILED" : "ok");
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int pairs, max_pairs = MAX_PAIRS, queue_count = 0, i;
+    int opt, use_mmap = 0, fault = 0, ret = 0;
+
+    while ((opt = getopt(argc, argv, "fmn:p:")) != -1) {
+        switch (opt) {
+        case 'f':
+            fault = 1;
+            break;
+        case 'm':
+            use_mmap = 1;
+            break;
+        case 'n':
+            count = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            max_pairs = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-m | -f] [-n messages per producer] [-p max pairs] [/dev/message_queue0 ...]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (max_pairs < 1 || max_pairs > MAX_PAIRS || count < 1 || argc - optind > MAX_QUEUES) {
+        fprintf(stderr, "pairs must be 1..%u, messages at least 1, queues at most %u\n", MAX_PAIRS, MAX_QUEUES);
+        return EXIT_FAILURE;
+    }
+    if (fault && use_mmap) {
+        fprintf(stderr, "-f checks the write path, the mmapped ring has none\n");
+        return EXIT_FAILURE;
+    }
+
+    for (; optind < argc; optind++)
+        mq_queue_init(&queues[queue_count++], argv[optind], sizeof(struct mq_payload), use_mmap);
+    if (!queue_count)
+        mq_queue_init(&queues[queue_count++], "/dev/message_queue0", sizeof(struct mq_payload), use_mmap);
+
+    if (fault) {
+        for (i = 0; i < queue_count; i++)
+            if (fault_check(&queues[i]))
+                ret = EXIT_FAILURE;
+        return ret;
+    }
+    for (pairs = 1; pairs <= max_pairs; pairs *= 2)
+        for (i = 0; i < queue_count; i++)
+            if (run(&queues[i], pairs))
+                ret = EXIT_FAILURE;
+    return ret;
+}